@@ -1,8 +1,16 @@
 #include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
 #include <fstream>
 #include <jsoncpp/json/reader.h>
 #include <jsoncpp/json/value.h>
+#include <limits>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
 #include <unordered_map>
 
 #ifndef NDEBUG
@@ -10,10 +18,13 @@
 #endif
 
 #include "ast.h"
+#include "ast_internal.h"
+#include "eval.h"
+#include "generate.h"
+#include "ir.h"
+#include "llvm.h"
 #include "utils.h"
 
-namespace {
-
 std::unordered_map<std::string, Ast::Kind> termLookupTable = {
     {"Int", Ast::IntKind},
     {"Str", Ast::StrKind},
@@ -29,6 +40,8 @@ std::unordered_map<std::string, Ast::Kind> termLookupTable = {
     {"Tuple", Ast::TupleKind},
     {"Var", Ast::VarKind}};
 
+namespace {
+
 std::unordered_map<std::string, Ast::BinaryOp> binaryOpLookupTable = {
     {"Add", Ast::Add}, {"Sub", Ast::Sub}, {"Mul", Ast::Mul}, {"Div", Ast::Div},
     {"Rem", Ast::Rem}, {"Eq", Ast::Eq},   {"Neq", Ast::Neq}, {"Lt", Ast::Lt},
@@ -71,21 +84,86 @@ Ast::BinaryOp createBinaryOpFromJson(const Json::Value &json) {
   return binaryOpLookupTable[json.asString()];
 }
 
+Ast::Location createLocationFromJson(const Json::Value &json) {
+  return {json["filename"].asString(), json["start"].asInt(),
+          json["end"].asInt()};
+}
+
 Ast::Parameter createParameterFromJson(const Json::Value &json) {
   has_properties_or_abort(json, "text", "location");
   return {json["text"].asString()};
 }
 
-std::unique_ptr<Ast::Node> createTermFromJson(const Json::Value &json) {
+} // namespace
+
+Ast::Kind getTermKind(const Json::Value &json) {
   has_properties_or_abort(json, "kind", "location");
 
-  const std::string &kind = json["kind"].asString();
-  if (!termLookupTable.contains(kind))
+  auto const kind = termLookupTable.find(json["kind"].asString());
+  if (kind == termLookupTable.end())
     ABORT("Term kind not recognized");
 
-  Ast::Kind const termKind = termLookupTable.find(kind)->second;
+  return kind->second;
+}
+
+void appendSubtermsFromJson(const Json::Value &json, Ast::Kind kind,
+                            std::vector<const Json::Value *> &subterms) {
+  switch (kind) {
+  case Ast::CallKind:
+    has_properties_or_abort(json, "arguments", "callee");
+    subterms.push_back(&json["callee"]);
+    for (auto const &item : json["arguments"])
+      subterms.push_back(&item);
+    return;
+
+  case Ast::BinaryKind:
+    has_properties_or_abort(json, "lhs", "op", "rhs");
+    subterms.push_back(&json["lhs"]);
+    subterms.push_back(&json["rhs"]);
+    return;
+
+  case Ast::FunctionKind:
+    has_properties_or_abort(json, "parameters", "value", "location");
+    subterms.push_back(&json["value"]);
+    return;
+
+  case Ast::LetKind:
+    has_properties_or_abort(json, "name", "value", "next");
+    subterms.push_back(&json["value"]);
+    subterms.push_back(&json["next"]);
+    return;
+
+  case Ast::IfKind:
+    has_properties_or_abort(json, "condition", "then", "otherwise");
+    subterms.push_back(&json["condition"]);
+    subterms.push_back(&json["then"]);
+    subterms.push_back(&json["otherwise"]);
+    return;
+
+  case Ast::PrintKind:
+  case Ast::FirstKind:
+  case Ast::SecondKind:
+    has_properties_or_abort(json, "value");
+    subterms.push_back(&json["value"]);
+    return;
+
+  case Ast::TupleKind:
+    has_properties_or_abort(json, "first", "second");
+    subterms.push_back(&json["first"]);
+    subterms.push_back(&json["second"]);
+    return;
+
+  default:
+    return;
+  }
+}
+
+namespace {
 
-  switch (termKind) {
+// Creates a term out of its subterms, which were already created
+Ast::Term createNodeFromJson(const Json::Value &json, Ast::Kind kind,
+                             Ast::Term *subterms, std::size_t numSubterms) {
+  switch (kind) {
   case Ast::IntKind:
     has_properties_or_abort(json, "value");
     return std::make_unique<Ast::Int>(json["value"].asInt());
@@ -94,30 +172,18 @@ std::unique_ptr<Ast::Node> createTermFromJson(const Json::Value &json) {
     has_properties_or_abort(json, "value");
     return std::make_unique<Ast::Str>(json["value"].asString());
 
-  case Ast::CallKind: {
-    has_properties_or_abort(json, "arguments", "callee");
-
-    auto const &jsonArgs = json["arguments"];
-    std::vector<std::unique_ptr<Ast::Node>> args;
-    args.reserve(jsonArgs.size());
-
-    std::for_each(jsonArgs.begin(), jsonArgs.end(), [&](auto &&item) {
-      args.push_back(createTermFromJson(item));
-    });
-
-    return std::make_unique<Ast::Call>(createTermFromJson(json["callee"]),
-                                       std::move(args));
-  }
+  case Ast::CallKind:
+    return std::make_unique<Ast::Call>(
+        std::move(subterms[0]),
+        std::vector<Ast::Term>(std::make_move_iterator(subterms + 1),
+                               std::make_move_iterator(subterms + numSubterms)));
 
   case Ast::BinaryKind:
-    has_properties_or_abort(json, "lhs", "op", "rhs");
-    return std::make_unique<Ast::Binary>(createTermFromJson(json["lhs"]),
+    return std::make_unique<Ast::Binary>(std::move(subterms[0]),
                                          createBinaryOpFromJson(json["op"]),
-                                         createTermFromJson(json["rhs"]));
+                                         std::move(subterms[1]));
 
   case Ast::FunctionKind: {
-    has_properties_or_abort(json, "parameters", "value", "location");
-
     auto const &jsonParams = json["parameters"];
     std::vector<Ast::Parameter> params;
     params.reserve(jsonParams.size());
@@ -126,42 +192,37 @@ std::unique_ptr<Ast::Node> createTermFromJson(const Json::Value &json) {
       params.push_back(createParameterFromJson(item));
     });
 
-    return std::make_unique<Ast::Function>(params,
-                                           createTermFromJson(json["value"]));
+    return std::make_unique<Ast::Function>(
+        params, std::move(subterms[0]),
+        createLocationFromJson(json["location"]));
   }
 
   case Ast::LetKind:
-    has_properties_or_abort(json, "name", "value", "next");
     return std::make_unique<Ast::Let>(createParameterFromJson(json["name"]),
-                                      createTermFromJson(json["value"]),
-                                      createTermFromJson(json["next"]));
+                                      std::move(subterms[0]),
+                                      std::move(subterms[1]));
 
   case Ast::IfKind:
-    has_properties_or_abort(json, "condition", "then", "otherwise");
-    return std::make_unique<Ast::If>(createTermFromJson(json["condition"]),
-                                     createTermFromJson(json["then"]),
-                                     createTermFromJson(json["otherwise"]));
+    return std::make_unique<Ast::If>(std::move(subterms[0]),
+                                     std::move(subterms[1]),
+                                     std::move(subterms[2]));
 
   case Ast::PrintKind:
-    has_properties_or_abort(json, "value");
-    return std::make_unique<Ast::Print>(createTermFromJson(json["value"]));
+    return std::make_unique<Ast::Print>(std::move(subterms[0]));
 
   case Ast::FirstKind:
-    has_properties_or_abort(json, "value");
-    return std::make_unique<Ast::First>(createTermFromJson(json["value"]));
+    return std::make_unique<Ast::First>(std::move(subterms[0]));
 
   case Ast::SecondKind:
-    has_properties_or_abort(json, "value");
-    return std::make_unique<Ast::Second>(createTermFromJson(json["value"]));
+    return std::make_unique<Ast::Second>(std::move(subterms[0]));
 
   case Ast::BoolKind:
     has_properties_or_abort(json, "value");
     return std::make_unique<Ast::Bool>(json["value"].asBool());
 
   case Ast::TupleKind:
-    has_properties_or_abort(json, "first", "second");
-    return std::make_unique<Ast::Tuple>(createTermFromJson(json["first"]),
-                                        createTermFromJson(json["second"]));
+    return std::make_unique<Ast::Tuple>(std::move(subterms[0]),
+                                        std::move(subterms[1]));
 
   case Ast::VarKind:
     has_properties_or_abort(json, "text");
@@ -180,281 +241,380 @@ std::unique_ptr<Ast::Node> createTermFromJson(const Json::Value &json) {
   __builtin_unreachable();
 }
 
-int anon_counter = 0;
+} // namespace
 
-std::unordered_map<Ast::Term::pointer, std::string> functionNameCache;
+// Terms are created bottom-up with explicit stacks instead of recursion, so
+// how deep a program nests (e.g. a long chain of lets) is only limited by
+// memory
+Ast::Term createTermFromJson(const Json::Value &root) {
+  struct Pending {
+    const Json::Value *json;
+    Ast::Kind kind;
+    // Set once the subterms were pushed, to be created before this term
+    bool expanded;
+    std::size_t numSubterms;
+  };
+
+  std::vector<Pending> pending{{&root, getTermKind(root), false, 0}};
+  std::vector<Ast::Term> created;
+  std::vector<const Json::Value *> subterms;
+
+  while (!pending.empty()) {
+    auto &term = pending.back();
+    if (term.expanded) {
+      std::size_t const first = created.size() - term.numSubterms;
+      auto node = createNodeFromJson(*term.json, term.kind,
+                                     created.data() + first, term.numSubterms);
+      created.resize(first);
+      created.push_back(std::move(node));
+      pending.pop_back();
+      continue;
+    }
 
-static inline std::string getStringValueOfTerm(const Ast::Term &value,
-                                               const Ast::Term &parent,
-                                               std::ofstream &file) {
-  std::string response;
-  switch (value->kind) {
-  case Ast::IntKind: {
-    response.append(
-        std::to_string(static_cast<Ast::Int *>(value.get())->value));
-    return response;
-  }
+    subterms.clear();
+    appendSubtermsFromJson(*term.json, term.kind, subterms);
+    term.expanded = true;
+    term.numSubterms = subterms.size();
 
-  case Ast::BoolKind: {
-    response.append(static_cast<Ast::Bool *>(value.get())->value ? "true"
-                                                                 : "false");
-    return response;
+    // Pushed in reverse so they are created in order
+    for (auto it = subterms.rbegin(); it != subterms.rend(); ++it)
+      pending.push_back({*it, getTermKind(**it), false, 0});
   }
 
-  case Ast::StrKind: {
-    response.append("\"")
-        .append(static_cast<Ast::Str *>(value.get())->value)
-        .append("\"");
-    return response;
+  return std::move(created.back());
+}
+
+namespace {
+
+GenerateOptions options;
+
+// Whether op can be written as the plain operator, because the operands'
+// types are known and it would mean the same as the helper
+bool hasNativeOp(Ast::BinaryOp op, Ir::Type lhs, Ir::Type rhs) {
+  if (lhs != rhs)
+    return false;
+  if (op == Ast::Eq || op == Ast::Neq)
+    return lhs == Ir::IntType || lhs == Ir::BoolType;
+  return lhs == Ir::IntType;
+}
+
+std::string getNativeOpString(Ast::BinaryOp op) {
+  switch (op) {
+  case Ast::Add:
+    return "+";
+  case Ast::Sub:
+    return "-";
+  case Ast::Mul:
+    return "*";
+  case Ast::Div:
+    return "/";
+  case Ast::Rem:
+    return "%";
+  case Ast::Eq:
+    return "==";
+  case Ast::Neq:
+    return "!=";
+  case Ast::Lt:
+    return "<";
+  case Ast::Gt:
+    return ">";
+  case Ast::Lte:
+    return "<=";
+  case Ast::Gte:
+    return ">=";
+  case Ast::And:
+    return "&&";
+  case Ast::Or:
+    return "||";
   }
+  __builtin_unreachable();
+}
 
-  case Ast::TupleKind: {
-    auto const &first_str = getStringValueOfTerm(
-        static_cast<Ast::Tuple *>(value.get())->first, value, file);
-    auto const &second_str = getStringValueOfTerm(
-        static_cast<Ast::Tuple *>(value.get())->second, value, file);
+// What the C++ emitter needs to know about the function being written
+struct EmittedFunction {
+  const Ir::Module &module;
+  const Ir::Function &f;
+  std::vector<const Ir::Instr *> definitions;
+
+  EmittedFunction(const Ir::Module &module, const Ir::Function &f)
+      : module(module), f(f), definitions(Ir::getDefinitions(f)) {}
+
+  bool isMain() const { return &f == &module.functions.back(); }
+
+  // Temporaries are named after their number, constants are written where
+  // they are used, and the function itself is the closure it was called on
+  std::string getValue(Ir::Value value) const {
+    if (value == f.self)
+      return "(*this)";
+
+    if (auto const *instr = definitions[value]) {
+      switch (instr->op) {
+      case Ir::IntOp:
+        return std::to_string(instr->number);
+      case Ir::BoolOp:
+        return instr->number ? "true" : "false";
+      case Ir::StrOp:
+        return getStringLiteral(instr->text, false);
+      default:
+        break;
+      }
+    }
+    return "t" + std::to_string(value);
+  }
 
-    response.append("__tuple<")
-        .append("decltype(")
-        .append(first_str)
-        .append(")")
-        .append(", ")
-        .append("decltype(")
-        .append(second_str)
-        .append(")>{")
-        .append(first_str)
-        .append(", ")
-        .append(second_str)
-        .append("}");
+  std::string getValues(const Ir::Value *values, std::size_t count) const {
+    std::string response;
+    for (std::size_t i = 0; i < count; i++) {
+      if (i)
+        response.append(", ");
+      response.append(getValue(values[i]));
+    }
     return response;
   }
 
-  case Ast::VarKind: {
-    response.append(static_cast<Ast::Var *>(value.get())->text);
-    return response;
+  // A condition must be a bool, which C++ only checks once it knows the type
+  std::string getCondition(Ir::Value value) const {
+    if (f.types[value] == Ir::BoolType)
+      return getValue(value);
+    return "__bool(" + getValue(value) + ")";
   }
 
-  case Ast::FunctionKind: {
-    if (functionNameCache.contains(value.get()))
-      return functionNameCache[value.get()];
+  std::string getInstr(const Ir::Instr &instr) const {
+    auto const &operands = instr.operands;
+    switch (instr.op) {
+    case Ir::IntOp:
+    case Ir::BoolOp:
+    case Ir::StrOp:
+      return {};
+
+    case Ir::BinaryOp: {
+      auto const lhs = getValue(operands[0]);
+      auto const rhs = getValue(operands[1]);
+      if (!hasNativeOp(instr.binaryOp, f.types[operands[0]],
+                       f.types[operands[1]]))
+        return getOpString(instr.binaryOp) + "(" + lhs + ", " + rhs + ")";
+      return "(" + lhs + " " + getNativeOpString(instr.binaryOp) + " " + rhs +
+             ")";
+    }
 
-    std::string name = (parent->kind == Ast::LetKind)
-                           ? static_cast<Ast::Let *>(parent.get())->name
-                           : "__anon_fn_" + (std::to_string(anon_counter++));
+    case Ir::CallOp:
+      return getValue(operands[0]) + "(" +
+             getValues(operands.data() + 1, operands.size() - 1) + ")";
 
-    // We only care about functions that are either set to a variable or that
-    // are immediately called
-    bool const generate_def =
-        (parent->kind == Ast::LetKind) || (parent->kind == Ast::CallKind);
+    case Ir::ClosureOp:
+      return module.functions[instr.number].name + "{" +
+             getValues(operands.data(), operands.size()) + "}";
 
-    auto const &f = static_cast<Ast::Function *>(value.get());
-    std::size_t const numParams = f->parameters.size();
+    case Ir::TupleOp:
+      return "__tuple{" + getValues(operands.data(), 2) + "}";
 
-    std::string function_def;
-    if (generate_def) {
-      if (numParams) {
-        function_def.append("template <");
-        for (std::size_t i = 0; i < numParams; i++) {
-          function_def.append("typename T").append(std::to_string(i));
-          if (i < (numParams - 1))
-            function_def.append(", ");
-        }
-        function_def.append(">");
-      }
-
-      function_def.append("auto ").append(name).append("(");
-      for (std::size_t i = 0; i < numParams; i++) {
-        function_def.append("T")
-            .append(std::to_string(i))
-            .append(" ")
-            .append(f->parameters[i]);
-        if (i < (numParams - 1))
-          function_def.append(", ");
-      }
-      function_def.append(") {");
-
-      // If the body doesn't start with let, function, or if, it's a return
-      bool const must_return = f->value->kind != Ast::LetKind &&
-                               f->value->kind != Ast::IfKind &&
-                               f->value->kind != Ast::FunctionKind;
-      if (must_return)
-        function_def.append("return ");
-
-      function_def.append(getStringValueOfTerm(f->value, value, file));
-
-      if (must_return)
-        function_def.append(";");
-
-      function_def.append("}");
-
-      // If the parent was a call, we need to return the name of the function
-      // with the template instantiated
-      if (parent->kind == Ast::CallKind) {
-        auto const &c = static_cast<Ast::Call *>(parent.get());
-        std::size_t const numArgs = c->arguments.size();
-        if (numArgs) {
-          name.append("<");
-          for (std::size_t i = 0; i < numArgs; i++) {
-
-            // We won't be adding the current function to the name
-            if (c->arguments[i] == value)
-              continue;
-
-            name.append("decltype(")
-                .append(getStringValueOfTerm(c->arguments[i], value, file))
-                .append(")");
-            if (i < (numArgs - 1))
-              name.append(", ");
-          }
-          name.append(">");
-        }
-      }
-    } else {
-      // Anon function: generate as lambda
-      function_def.append("void ").append(name).append("() {};");
-    }
+    case Ir::FirstOp:
+      return "__first(" + getValue(operands[0]) + ")";
 
-    file << function_def;
+    case Ir::SecondOp:
+      return "__second(" + getValue(operands[0]) + ")";
 
-    functionNameCache[value.get()] = name;
-    return name;
-  }
-
-  case Ast::CallKind: {
-    response
-        .append(getStringValueOfTerm(
-            static_cast<Ast::Call *>(value.get())->callee, value, file))
-        .append("(");
+    case Ir::PrintOp:
+      return "print(" + getValue(operands[0]) + ")";
 
-    auto const &c = static_cast<Ast::Call *>(value.get());
-    std::size_t const numArgs = c->arguments.size();
-    for (std::size_t i = 0; i < numArgs; i++) {
-      response.append(getStringValueOfTerm(c->arguments[i], value, file));
-      if (i < (numArgs - 1))
-        response.append(", ");
+    case Ir::UnboundOp:
+      return instr.text;
     }
-
-    return response.append(")");
+    __builtin_unreachable();
   }
 
-  case Ast::BinaryKind: {
-    response.append(getOpString(static_cast<Ast::Binary *>(value.get())->op))
-        .append("(")
-        .append(getStringValueOfTerm(
-            static_cast<Ast::Binary *>(value.get())->lhs, value, file))
-        .append(", ")
-        .append(getStringValueOfTerm(
-            static_cast<Ast::Binary *>(value.get())->rhs, value, file))
-        .append(")");
-    return response;
-  }
+  // Appends block and the blocks it flows into, following branches, until
+  // one returns or jumps to the join of the enclosing branch. Returns the
+  // value it jumps with, or NoValue if it returned
+  Ir::Value appendBlocks(Ir::BlockId block, std::string &response) const {
+    for (;;) {
+      for (auto const &instr : f.blocks[block].instrs) {
+        auto const value = getInstr(instr);
+        if (value.empty())
+          continue;
+        response.append("auto ")
+            .append(getValue(instr.result))
+            .append(" = ")
+            .append(value)
+            .append(";\n");
+      }
 
-  case Ast::LetKind: {
-    auto rhs = getStringValueOfTerm(static_cast<Ast::Let *>(value.get())->value,
-                                    value, file);
-
-    // Special case functions
-    auto const &v = static_cast<Ast::Let *>(value.get())->value;
-    auto const &name = static_cast<Ast::Let *>(value.get())->name;
-    if (v->kind != Ast::FunctionKind) {
-      if (name != "_")
-        response.append("auto ").append(name).append(" = ");
-      response.append(rhs).append(";\n");
-    }
+      auto const &terminator = f.blocks[block].terminator;
+      switch (terminator.kind) {
+      // The value of the program itself is dropped
+      case Ir::ReturnKind:
+        if (!isMain())
+          response.append("return ")
+              .append(getValue(terminator.value))
+              .append(";\n");
+        return Ir::NoValue;
+
+      case Ir::JumpKind:
+        return terminator.value;
+
+      case Ir::BranchKind:
+        break;
+      }
 
-    auto const &next = static_cast<Ast::Let *>(value.get())->next;
-    auto const &body = getStringValueOfTerm(next, parent, file);
+      auto const condition = getCondition(terminator.value);
+      if (terminator.join == Ir::NoBlock) {
+        response.append("if (").append(condition).append(") {\n");
+        appendBlocks(terminator.target, response);
+        response.append("} else {\n");
+        appendBlocks(terminator.otherwise, response);
+        response.append("}\n");
+        return Ir::NoValue;
+      }
 
-    {
-      bool const must_return = (next->kind != Ast::LetKind &&
-                                next->kind != Ast::IfKind && parent != nullptr);
-      add_return_if_needed;
-      response.append(body);
-      add_semicolon_if_needed;
+      // An if in the middle of a function has a value, so it becomes a
+      // ternary of lambdas that only runs one
+      auto const join = getValue(f.blocks[terminator.join].parameter);
+      response.append("auto ")
+          .append(join)
+          .append(" = ")
+          .append(condition)
+          .append(" ? ");
+      appendArm(terminator.target, response);
+      response.append(" : ");
+      appendArm(terminator.otherwise, response);
+      response.append(";\n");
+      block = terminator.join;
     }
-
-    return response;
   }
 
-  case Ast::IfKind: {
-    auto const &cond = getStringValueOfTerm(
-        static_cast<Ast::If *>(value.get())->condition, value, file);
-
-    bool const print_as_ternary =
-        !((parent == nullptr) || (parent->kind == Ast::FunctionKind));
-    if (print_as_ternary)
-      response.append(cond).append(" ? ");
-    else
-      response.append("if (").append(cond).append(") {\n");
-
-    {
-      auto const &then = static_cast<Ast::If *>(value.get())->then;
-      auto const &then_str = getStringValueOfTerm(then, value, file);
-
-      bool const must_return =
-          !print_as_ternary && (then->kind != Ast::LetKind);
-      add_return_if_needed;
-      response.append(then_str);
-      add_semicolon_if_needed;
+  // Appended in place, as copying each arm into the one around it would be
+  // quadratic in how deep ifs are nested
+  void appendArm(Ir::BlockId block, std::string &response) const {
+    std::size_t const start = response.size();
+    response.append("[&] {\n");
+    std::size_t const bodyStart = response.size();
+    auto const value = getValue(appendBlocks(block, response));
+    if (response.size() == bodyStart) {
+      response.resize(start);
+      response.append(value);
+      return;
     }
+    response.append("return ").append(value).append(";\n}()");
+  }
 
-    if (print_as_ternary)
-      response.append(" : ");
-    else
-      response.append(" } else {");
-
-    {
-      auto const &otherwise = static_cast<Ast::If *>(value.get())->otherwise;
-      auto const &otherwise_str = getStringValueOfTerm(otherwise, value, file);
-
-      bool const must_return =
-          !print_as_ternary && (otherwise->kind != Ast::LetKind);
+  // Closures are structs holding their captures, called through operator()
+  std::string getCppDefinition() const {
+    std::string function_def;
 
-      add_return_if_needed;
-      response.append(otherwise_str);
-      add_semicolon_if_needed;
+    // Each function gets its own counters, shared by all instantiations
+    std::string const profile_entry = "__prof_" + f.name;
+    if (options.profile)
+      function_def.append("static __prof_entry ")
+          .append(profile_entry)
+          .append("{")
+          .append(getStringLiteral(f.source.empty() ? f.name : f.source,
+                                   false))
+          .append(", ")
+          .append(getStringLiteral(f.location.filename, false))
+          .append(", ")
+          .append(std::to_string(f.location.start))
+          .append(", ")
+          .append(std::to_string(f.location.end))
+          .append("};\n");
+
+    std::size_t const numCaptures = f.captures.size();
+    std::string captureTypes;
+    for (std::size_t i = 0; i < numCaptures; i++)
+      captureTypes.append(i ? ", " : "").append("C").append(std::to_string(i));
+
+    if (numCaptures) {
+      function_def.append("template <");
+      for (std::size_t i = 0; i < numCaptures; i++)
+        function_def.append(i ? ", " : "")
+            .append("typename C")
+            .append(std::to_string(i));
+      function_def.append("> ");
+    }
+    function_def.append("struct ").append(f.name).append(" {\n");
+
+    for (std::size_t i = 0; i < numCaptures; i++)
+      function_def.append("C")
+          .append(std::to_string(i))
+          .append(" ")
+          .append(getValue(f.captures[i]))
+          .append(";\n");
+
+    std::size_t const numParams = f.parameters.size();
+    if (numParams) {
+      function_def.append("template <");
+      for (std::size_t i = 0; i < numParams; i++)
+        function_def.append(i ? ", " : "")
+            .append("typename T")
+            .append(std::to_string(i));
+      function_def.append("> ");
     }
 
-    if (!print_as_ternary)
-      response.append("}");
-
-    return response;
+    function_def.append("auto operator()(");
+    for (std::size_t i = 0; i < numParams; i++)
+      function_def.append(i ? ", " : "")
+          .append("T")
+          .append(std::to_string(i))
+          .append(" ")
+          .append(getValue(f.parameters[i]));
+    function_def.append(") const {\n");
+
+    if (options.profile)
+      function_def.append("__prof_scope __prof_guard(")
+          .append(profile_entry)
+          .append(");\n");
+
+    appendBlocks(0, function_def);
+    function_def.append("}\n};\n");
+
+    // Lets f{captures...} deduce the types of the captures
+    if (numCaptures) {
+      function_def.append("template <");
+      for (std::size_t i = 0; i < numCaptures; i++)
+        function_def.append(i ? ", " : "")
+            .append("typename C")
+            .append(std::to_string(i));
+      function_def.append("> ")
+          .append(f.name)
+          .append("(")
+          .append(captureTypes)
+          .append(") -> ")
+          .append(f.name)
+          .append("<")
+          .append(captureTypes)
+          .append(">;\n");
+    }
+    return function_def;
   }
+};
 
-  case Ast::PrintKind: {
-    response.append("print(")
-        .append(getStringValueOfTerm(
-            static_cast<Ast::Print *>(value.get())->value, value, file))
-        .append(")");
-    return response;
-  }
+} // namespace
 
-  case Ast::FirstKind: {
-    response.append("__first(")
-        .append(getStringValueOfTerm(
-            static_cast<Ast::Print *>(value.get())->value, value, file))
-        .append(")");
-    return response;
-  }
+// Functions come first, each after the ones it creates, then the program
+void writeCpp(const Ir::Module &module, std::ofstream &file) {
+  for (auto const &f : module.functions) {
+    if (&f == &module.functions.back())
+      break;
 
-  case Ast::SecondKind: {
-    response.append("__second(")
-        .append(getStringValueOfTerm(
-            static_cast<Ast::Print *>(value.get())->value, value, file))
-        .append(")");
-    return response;
+    file << EmittedFunction(module, f).getCppDefinition();
   }
 
-  case Ast::ProgramKind:;
-  }
+  std::string main_body;
+  EmittedFunction(module, module.functions.back()).appendBlocks(0, main_body);
 
-  ABORT(std::string("Missing support for term ")
-            .append(std::to_string(value->kind)));
-  __builtin_unreachable();
+  file << "int main() {\n";
+  file << main_body;
+  file << "return 0;\n";
+  file << "}\n";
 }
 
-static inline std::string
-getJulia(const Ast::Term &value, const Ast::Term &parent, std::ofstream &file) {
+namespace {
+
+// Julia names anonymous functions by a counter
+int anon_counter = 0;
+
+// The Julia backend is only the fallback for programs the C++ one can't
+// build, and is written straight from the AST as it always was
+std::string getJulia(const Ast::Term &value, std::ofstream &file) {
   std::string response;
   switch (value->kind) {
   case Ast::IntKind:
@@ -466,50 +626,40 @@ getJulia(const Ast::Term &value, const Ast::Term &parent, std::ofstream &file) {
                                                          : " false ");
 
   case Ast::StrKind:
-    return response.append(" \"")
-        .append(static_cast<Ast::Str *>(value.get())->value)
-        .append("\"");
+    return response.append(" ").append(
+        getStringLiteral(static_cast<Ast::Str *>(value.get())->value, true));
 
   case Ast::VarKind:
     return static_cast<Ast::Var *>(value.get())->text;
 
   case Ast::TupleKind:
     return response.append(" (")
-        .append(getJulia(static_cast<Ast::Tuple *>(value.get())->first, value,
-                         file))
+        .append(getJulia(static_cast<Ast::Tuple *>(value.get())->first, file))
         .append(", ")
-        .append(getJulia(static_cast<Ast::Tuple *>(value.get())->second, value,
-                         file))
+        .append(getJulia(static_cast<Ast::Tuple *>(value.get())->second, file))
         .append(")");
 
   case Ast::BinaryKind:
     return response
         .append(getOpString(static_cast<Ast::Binary *>(value.get())->op))
         .append("(")
-        .append(
-            getJulia(static_cast<Ast::Binary *>(value.get())->lhs, value, file))
+        .append(getJulia(static_cast<Ast::Binary *>(value.get())->lhs, file))
         .append(", ")
-        .append(
-            getJulia(static_cast<Ast::Binary *>(value.get())->rhs, value, file))
+        .append(getJulia(static_cast<Ast::Binary *>(value.get())->rhs, file))
         .append(") ");
 
   case Ast::PrintKind:
     return response.append(" __print(")
-        .append(getJulia(static_cast<Ast::Print *>(value.get())->value, value,
-                         file))
+        .append(getJulia(static_cast<Ast::Print *>(value.get())->value, file))
         .append(")\n");
 
   case Ast::CallKind: {
-    response.append(" ")
-        .append(getJulia(static_cast<Ast::Call *>(value.get())->callee, value,
-                         file))
-        .append("(");
-
     auto const &c = static_cast<Ast::Call *>(value.get());
+    response.append(" ").append(getJulia(c->callee, file)).append("(");
+
     std::size_t const numArgs = c->arguments.size();
     for (std::size_t i = 0; i < numArgs; i++) {
-      response.append(getJulia(
-          static_cast<Ast::Call *>(value.get())->arguments[i], value, file));
+      response.append(getJulia(c->arguments[i], file));
       if (i < (numArgs - 1))
         response.append(", ");
     }
@@ -530,45 +680,46 @@ getJulia(const Ast::Term &value, const Ast::Term &parent, std::ofstream &file) {
         file << ", ";
     }
     file << ")\n";
-    file << getJulia(static_cast<Ast::Function *>(value.get())->value, value,
-                     file);
+    file << getJulia(f->value, file);
     file << "\nend\n";
     return name;
   }
 
-  case Ast::LetKind:
-    return response.append(" ")
-        .append(static_cast<Ast::Let *>(value.get())->name)
-        .append(" = ")
-        .append(
-            getJulia(static_cast<Ast::Let *>(value.get())->value, value, file))
-        .append("\n")
-        .append(
-            getJulia(static_cast<Ast::Let *>(value.get())->next, value, file))
-        .append("\n");
+  // Chains of lets are written in a loop, with the newline each one ends
+  // with added once the chain is done
+  case Ast::LetKind: {
+    const Ast::Term *term = &value;
+    std::size_t count = 0;
+    for (; (*term)->kind == Ast::LetKind; count++) {
+      auto const &let = static_cast<Ast::Let *>(term->get());
+      response.append(" ")
+          .append(let->name)
+          .append(" = ")
+          .append(getJulia(let->value, file))
+          .append("\n");
+      term = &let->next;
+    }
+    response.append(getJulia(*term, file));
+    return response.append(count, '\n');
+  }
 
   case Ast::FirstKind:
     return response.append(" ")
-        .append(getJulia(static_cast<Ast::First *>(value.get())->value, value,
-                         file))
+        .append(getJulia(static_cast<Ast::First *>(value.get())->value, file))
         .append("[1]");
 
   case Ast::SecondKind:
     return response.append(" ")
-        .append(getJulia(static_cast<Ast::First *>(value.get())->value, value,
-                         file))
+        .append(getJulia(static_cast<Ast::Second *>(value.get())->value, file))
         .append("[2]");
 
   case Ast::IfKind:
     return response.append(" if ")
-        .append(getJulia(static_cast<Ast::If *>(value.get())->condition, value,
-                         file))
+        .append(getJulia(static_cast<Ast::If *>(value.get())->condition, file))
         .append("\n")
-        .append(
-            getJulia(static_cast<Ast::If *>(value.get())->then, value, file))
+        .append(getJulia(static_cast<Ast::If *>(value.get())->then, file))
         .append("\nelse\n")
-        .append(getJulia(static_cast<Ast::If *>(value.get())->otherwise, value,
-                         file))
+        .append(getJulia(static_cast<Ast::If *>(value.get())->otherwise, file))
         .append("\nend\n");
 
   case Ast::ProgramKind:;
@@ -581,33 +732,170 @@ getJulia(const Ast::Term &value, const Ast::Term &parent, std::ofstream &file) {
 
 } // namespace
 
-int generateFromJson(const char *pathToJson, const char *mode) {
-  std::ifstream fss(pathToJson);
+void writeJulia(const Ast::Term &program, std::ofstream &file) {
+  file << getJulia(program, file);
+}
+
+namespace {
+
+using StatsClock = std::chrono::steady_clock;
+
+// Reports how long a phase took and the peak memory of the process so far
+void reportPhase(const char *phase, StatsClock::time_point &start) {
+  if (!options.stats)
+    return;
+
+  auto const now = StatsClock::now();
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  fprintf(stderr, "%s\t%.3f\t%ld\n", phase,
+          std::chrono::duration<double, std::milli>(now - start).count(),
+          usage.ru_maxrss);
+  start = now;
+}
+
+} // namespace
+
+void runOnStack(std::size_t stackSize, void *(*start)(void *), void *arg) {
+  // The lowest page is left inaccessible, so overflowing still crashes
+  std::size_t const guardSize = sysconf(_SC_PAGESIZE);
+  stackSize = (stackSize + guardSize - 1) / guardSize * guardSize;
+  void *const stack =
+      mmap(nullptr, stackSize + guardSize, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+  if (stack == MAP_FAILED)
+    ABORT("Could not reserve stack");
+  mprotect(stack, guardSize, PROT_NONE);
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstack(&attr, static_cast<char *>(stack) + guardSize,
+                        stackSize);
+
+  pthread_t thread;
+  if (pthread_create(&thread, &attr, start, arg))
+    ABORT("Could not create thread");
+  pthread_join(thread, nullptr);
+  pthread_attr_destroy(&attr);
+  munmap(stack, stackSize + guardSize);
+}
+
+namespace {
+
+// jsoncpp reads and frees values recursively, a few frames per level of
+// nesting, and so do lowering and the backends. A level takes at least a few
+// dozen bytes of JSON, so a stack a few times the size of the file is enough
+// for however deep the program is
+std::size_t getJsonStackSize(const char *pathToJson) {
+  std::error_code error;
+  auto const size = std::filesystem::file_size(pathToJson, error);
+  return std::max<std::size_t>(error ? 0 : size * 16, 8u << 20);
+}
+
+} // namespace
+
+int generateFromJson(const char *pathToJson, const char *mode,
+                     const GenerateOptions &generateOptions) {
+  options = generateOptions;
+
+  auto phaseStart = StatsClock::now();
+  std::size_t const jsonStackSize = getJsonStackSize(pathToJson);
 
   Json::Value json;
-  Json::Reader reader;
-  reader.parse(fss, json);
+  runWithStack(jsonStackSize, [&] {
+    std::ifstream fss(pathToJson);
+    Json::CharReaderBuilder builder;
+    builder["stackLimit"] = std::numeric_limits<int>::max();
+
+    std::string errors;
+    if (!Json::parseFromStream(builder, fss, &json, &errors))
+      ABORT(errors);
+  });
+  reportPhase("json", phaseStart);
 
   has_properties_or_abort(json, "name", "expression", "location");
   auto ast = createTermFromJson(json["expression"]);
+  runWithStack(jsonStackSize, [&] { Json::Value().swap(json); });
+  reportPhase("ast", phaseStart);
 
+  // A profile is of the program as written, so it is not run ahead of time
   std::ofstream file;
-  if (atoi(mode)) {
-    file.open("generated_main.cpp");
-    file << "#include \"out.h\"\n\n";
+  if (options.evaluate && !options.profile) {
+    // The interpreter only recurses up to its depth budget, but its frames
+    // are larger than the backends' ones
+    Eval::Result result;
+    runWithStack(jsonStackSize, [&] {
+      result = Eval::run(std::move(ast),
+                         {options.fuel, options.fuelBytes, options.fuelMs});
+    });
+    reportPhase("eval", phaseStart);
+
+    // The runner only has to write what the program printed, and run.sh
+    // doesn't even need to build it
+    if (result.complete) {
+      file.open("generated_output.txt");
+      file << result.output;
+      file.close();
+
+      if (atoi(mode) == 2) {
+        file.open("generated_main.ll");
+        file << Llvm::emitOutput(result.output);
+      } else if (atoi(mode)) {
+        file.open("generated_main.cpp");
+        file << "#include <cstdio>\n\n";
+        file << "int main() {\n";
+        file << "fwrite(" << getStringLiteral(result.output, false) << ", 1, "
+             << result.output.size() << ", stdout);\n";
+        file << "return 0;\n";
+        file << "}\n";
+      } else {
+        file.open("generated_main.jl");
+        file << "print(" << getStringLiteral(result.output, true) << ")\n";
+      }
+      file.close();
+      reportPhase("codegen", phaseStart);
+      return 0;
+    }
 
-    auto main_body = getStringValueOfTerm(ast, nullptr, file);
+    ast = std::move(result.residual);
+  }
 
-    file << "int main() {\n";
-    file << main_body << ";\n";
-    file << "return 0;\n";
-    file << "}\n";
-    file.close();
-  } else {
-    file.open("generated_main.jl");
-    file << "include(\"builtin.jl\")\n\n";
-    file << getJulia(ast, nullptr, file);
+  // Lowering and each backend also recurse once per level of nesting
+  Ir::Module module;
+  runWithStack(jsonStackSize,
+               [&] { module = Ir::lower(ast, !options.profile); });
+  reportPhase("ir", phaseStart);
+
+  if (options.emitIr) {
+    file.open("generated_main.ir");
+    file << Ir::print(module);
     file.close();
   }
+
+  // Only the C++ runner can be profiled
+  if (atoi(mode) == 2 && options.profile)
+    return 1;
+
+  runWithStack(jsonStackSize, [&] {
+    if (atoi(mode) == 2) {
+      file.open("generated_main.ll");
+      file << Llvm::emit(module);
+      file.close();
+    } else if (atoi(mode)) {
+      file.open("generated_main.cpp");
+      if (options.profile)
+        file << "#define RINHA_PROFILE\n";
+      file << "#include \"out.h\"\n\n";
+      writeCpp(module, file);
+      file.close();
+    } else {
+      file.open("generated_main.jl");
+      file << "include(\"builtin.jl\")\n\n";
+      writeJulia(ast, file);
+      file.close();
+    }
+  });
+  reportPhase("codegen", phaseStart);
   return 0;
 }
\ No newline at end of file
@@ -34,6 +34,30 @@ struct Node {
 
 using Term = std::unique_ptr<Node>;
 
+// Nodes hand their children to reclaim instead of destroying them in place,
+// so tearing down a long chain of lets takes a loop instead of one stack
+// frame per node
+inline void reclaim(Term &term) {
+  static thread_local std::vector<Term> *pending = nullptr;
+  if (!term)
+    return;
+
+  if (pending) {
+    pending->push_back(std::move(term));
+    return;
+  }
+
+  std::vector<Term> stack;
+  pending = &stack;
+  stack.push_back(std::move(term));
+  while (!stack.empty()) {
+    Term node = std::move(stack.back());
+    stack.pop_back();
+    node.reset();
+  }
+  pending = nullptr;
+}
+
 struct Int : public Node {
   int32_t value{};
   explicit Int(int32_t value) : Node(IntKind), value(value) {}
@@ -58,7 +82,11 @@ struct Call : public Node {
   Call(Term callee, std::vector<Term> arguments)
       : Node(CallKind), callee(std::move(callee)),
         arguments(std::move(arguments)) {}
-  ~Call() override = default;
+  ~Call() override {
+    reclaim(callee);
+    for (auto &argument : arguments)
+      reclaim(argument);
+  }
 } __attribute__((aligned(32)));
 
 struct Binary : public Node {
@@ -67,7 +95,10 @@ struct Binary : public Node {
   Term rhs{};
   Binary(Term lhs, BinaryOp op, Term rhs)
       : Node(BinaryKind), lhs(std::move(lhs)), op(op), rhs(std::move(rhs)) {}
-  ~Binary() override = default;
+  ~Binary() override {
+    reclaim(lhs);
+    reclaim(rhs);
+  }
 } __attribute__((aligned(32)));
 
 struct Tuple : public Node {
@@ -75,7 +106,10 @@ struct Tuple : public Node {
   Term second{};
   Tuple(Term first, Term second)
       : Node(TupleKind), first(std::move(first)), second(std::move(second)) {}
-  ~Tuple() override = default;
+  ~Tuple() override {
+    reclaim(first);
+    reclaim(second);
+  }
 } __attribute__((aligned(16)));
 
 struct Var : public Node {
@@ -86,13 +120,20 @@ struct Var : public Node {
 
 using Parameter = std::string;
 
+struct Location {
+  std::string filename{};
+  int32_t start{}, end{};
+};
+
 struct Function : public Node {
   std::vector<Parameter> parameters{};
   Term value{};
-  Function(std::vector<Parameter> parameters, Term value)
+  Location location{};
+  Function(std::vector<Parameter> parameters, Term value,
+           Location location = {})
       : Node(FunctionKind), parameters(std::move(parameters)),
-        value(std::move(value)) {}
-  ~Function() override = default;
+        value(std::move(value)), location(std::move(location)) {}
+  ~Function() override { reclaim(value); }
 } __attribute__((aligned(32)));
 
 struct Let : public Node {
@@ -102,7 +143,10 @@ struct Let : public Node {
   Let(const Parameter &&name, Term value, Term next)
       : Node(LetKind), name(name), value(std::move(value)),
         next(std::move(next)){};
-  ~Let() override = default;
+  ~Let() override {
+    reclaim(value);
+    reclaim(next);
+  }
 } __attribute__((aligned(64)));
 
 struct If : public Node {
@@ -110,25 +154,29 @@ struct If : public Node {
   If(Term condition, Term then, Term otherwise)
       : Node(IfKind), condition(std::move(condition)), then(std::move(then)),
         otherwise(std::move(otherwise)) {}
-  ~If() override = default;
+  ~If() override {
+    reclaim(condition);
+    reclaim(then);
+    reclaim(otherwise);
+  }
 } __attribute__((aligned(32)));
 
 struct Print : public Node {
   Term value{};
   explicit Print(Term value) : Node(PrintKind), value(std::move(value)) {}
-  ~Print() override = default;
+  ~Print() override { reclaim(value); }
 };
 
 struct First : public Node {
   Term value{};
   explicit First(Term value) : Node(FirstKind), value(std::move(value)) {}
-  ~First() override = default;
+  ~First() override { reclaim(value); }
 };
 
 struct Second : public Node {
   Term value{};
   explicit Second(Term value) : Node(SecondKind), value(std::move(value)) {}
-  ~Second() override = default;
+  ~Second() override { reclaim(value); }
 };
 
 }; // namespace Ast
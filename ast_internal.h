@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstddef>
+#include <fstream>
+#include <jsoncpp/json/value.h>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include "ast.h"
+#include "ir.h"
+
+// Parts of ast.cpp that are not needed to compile a program, but that
+// cpp-rinher-bench times on their own.
+
+extern std::unordered_map<std::string, Ast::Kind> termLookupTable;
+
+Ast::Kind getTermKind(const Json::Value &json);
+
+// Appends the subterms of a term in the order createNodeFromJson takes them
+void appendSubtermsFromJson(const Json::Value &json, Ast::Kind kind,
+                            std::vector<const Json::Value *> &subterms);
+
+Ast::Term createTermFromJson(const Json::Value &root);
+
+// The backends, with the options of the last generateFromJson. Julia is
+// written from the AST, not the IR
+void writeCpp(const Ir::Module &module, std::ofstream &file);
+void writeJulia(const Ast::Term &program, std::ofstream &file);
+
+// Runs start(arg) on a thread of its own with a stack of the given size. The
+// stack is reserved without being committed, pages are only backed once
+// they are used
+void runOnStack(std::size_t stackSize, void *(*start)(void *), void *arg);
+
+template <typename F> void runWithStack(std::size_t stackSize, F &&f) {
+  using Fn = std::remove_reference_t<F>;
+  runOnStack(
+      stackSize,
+      [](void *arg) -> void * {
+        (*static_cast<Fn *>(arg))();
+        return nullptr;
+      },
+      &f);
+}
@@ -0,0 +1,246 @@
+// Generates synthetic Rinha ASTs, in the same JSON format the compiler reads,
+// to measure how each phase scales with the size of the program.
+//
+// Usage: cpp-rinher-astgen <shape> <nodes>
+//
+// The JSON is written to stdout and the number of nodes actually generated to
+// stderr. Deep shapes are written without recursion, so the generator itself
+// is not the limit on how deep a program can be.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+namespace {
+
+const char *location =
+    R"("location":{"start":0,"end":0,"filename":"gen.rinha"})";
+
+std::size_t nodes = 0;
+
+std::string text(const std::string &str) {
+  return std::string(R"({"text":")")
+      .append(str)
+      .append("\",")
+      .append(location)
+      .append("}");
+}
+
+std::string node(const char *kind, const std::string &fields) {
+  nodes++;
+  return std::string(R"({"kind":")")
+      .append(kind)
+      .append("\",")
+      .append(fields)
+      .append(",")
+      .append(location)
+      .append("}");
+}
+
+std::string intTerm(int value) {
+  return node("Int", "\"value\":" + std::to_string(value));
+}
+
+std::string varTerm(const std::string &name) {
+  return node("Var", "\"text\":\"" + name + "\"");
+}
+
+std::string binaryTerm(const std::string &lhs, const char *op,
+                       const std::string &rhs) {
+  return node("Binary", std::string(R"("lhs":)")
+                            .append(lhs)
+                            .append(R"(,"op":")")
+                            .append(op)
+                            .append(R"(","rhs":)")
+                            .append(rhs));
+}
+
+std::string printTerm(const std::string &value) {
+  return node("Print", "\"value\":" + value);
+}
+
+std::string callTerm(const std::string &callee,
+                     const std::string &arguments) {
+  return node("Call", std::string(R"("callee":)")
+                          .append(callee)
+                          .append(R"(,"arguments":[)")
+                          .append(arguments)
+                          .append("]"));
+}
+
+std::string functionTerm(const std::string &parameters,
+                         const std::string &value) {
+  return node("Function", std::string(R"("parameters":[)")
+                              .append(parameters)
+                              .append(R"(],"value":)")
+                              .append(value));
+}
+
+// Lets are nested through "next", so a chain of them is written as the list
+// of opening halves, the final expression, and then all the closing braces
+struct LetChain {
+  std::string open;
+  std::size_t count = 0;
+
+  void add(const std::string &name, const std::string &value) {
+    nodes++;
+    count++;
+    open.append(R"({"kind":"Let","name":)")
+        .append(text(name))
+        .append(R"(,"value":)")
+        .append(value)
+        .append(R"(,"next":)");
+  }
+
+  void finish(const std::string &last) {
+    fputs(open.c_str(), stdout);
+    fputs(last.c_str(), stdout);
+    for (std::size_t i = 0; i < count; i++)
+      printf(",%s}", location);
+  }
+};
+
+// Sum of the variables [begin, end) as a balanced tree of additions
+std::string sumOf(const std::string &prefix, std::size_t begin,
+                  std::size_t end) {
+  if (end - begin == 1)
+    return varTerm(prefix + std::to_string(begin));
+
+  std::size_t const middle = begin + (end - begin) / 2;
+  return binaryTerm(sumOf(prefix, begin, middle), "Add",
+                    sumOf(prefix, middle, end));
+}
+
+// let x0 = 0; let x1 = x0 + 1; ...; print(xN)
+void genLet(std::size_t size) {
+  std::size_t const count = std::max<std::size_t>(size / 4, 1);
+
+  LetChain chain;
+  chain.add("x0", intTerm(0));
+  for (std::size_t i = 1; i < count; i++)
+    chain.add("x" + std::to_string(i),
+              binaryTerm(varTerm("x" + std::to_string(i - 1)), "Add",
+                         intTerm(1)));
+
+  chain.finish(printTerm(varTerm("x" + std::to_string(count - 1))));
+}
+
+// let f = fn (a0, ..., aN) => a0 + ... + aN; print(f(0, ..., N))
+void genCall(std::size_t size) {
+  std::size_t const count = std::max<std::size_t>(size / 4, 1);
+
+  std::string parameters, arguments;
+  for (std::size_t i = 0; i < count; i++) {
+    if (i) {
+      parameters.append(",");
+      arguments.append(",");
+    }
+    parameters.append(text("a" + std::to_string(i)));
+    arguments.append(intTerm(static_cast<int>(i)));
+  }
+
+  LetChain chain;
+  chain.add("f", functionTerm(parameters, sumOf("a", 0, count)));
+  chain.finish(printTerm(callTerm(varTerm("f"), arguments)));
+}
+
+// Appends the innermost term and closes the count terms opened before it
+std::string close(std::string open, const std::string &last,
+                  std::size_t count) {
+  open.append(last);
+  for (std::size_t i = 0; i < count; i++)
+    open.append(",").append(location).append("}");
+  return open;
+}
+
+// print((0, (1, (2, ... N))))
+void genTuple(std::size_t size) {
+  std::size_t const count = std::max<std::size_t>(size / 2, 1);
+
+  std::string open;
+  for (std::size_t i = 0; i < count; i++) {
+    nodes++;
+    open.append(R"({"kind":"Tuple","first":)")
+        .append(intTerm(static_cast<int>(i)))
+        .append(R"(,"second":)");
+  }
+
+  fputs(printTerm(close(std::move(open), intTerm(static_cast<int>(count)),
+                        count))
+            .c_str(),
+        stdout);
+}
+
+// let f0 = fn (x) => x; let f1 = fn (x) => f0(x) + 1; ...; print(fN(0))
+void genFunctions(std::size_t size) {
+  std::size_t const count = std::max<std::size_t>(size / 7, 1);
+
+  LetChain chain;
+  chain.add("f0", functionTerm(text("x"), varTerm("x")));
+  for (std::size_t i = 1; i < count; i++)
+    chain.add("f" + std::to_string(i),
+              functionTerm(text("x"),
+                           binaryTerm(callTerm(varTerm("f" + std::to_string(i - 1)),
+                                               varTerm("x")),
+                                      "Add", intTerm(1))));
+
+  chain.finish(printTerm(callTerm(varTerm("f" + std::to_string(count - 1)),
+                                  intTerm(static_cast<int>(count)))));
+}
+
+// let n = N; print(if (n < 0) { 0 } else if (n < 1) { 1 } else ...)
+void genIf(std::size_t size) {
+  std::size_t const count = std::max<std::size_t>(size / 6, 1);
+
+  std::string open;
+  for (std::size_t i = 0; i < count; i++) {
+    nodes++;
+    open.append(R"({"kind":"If","condition":)")
+        .append(binaryTerm(varTerm("n"), "Lt", intTerm(static_cast<int>(i))))
+        .append(R"(,"then":)")
+        .append(intTerm(static_cast<int>(i)))
+        .append(R"(,"otherwise":)");
+  }
+
+  LetChain chain;
+  chain.add("n", intTerm(static_cast<int>(count / 2)));
+  chain.finish(printTerm(
+      close(std::move(open), intTerm(static_cast<int>(count)), count)));
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  if (argc != 3) {
+    fprintf(stderr, "usage: %s <let|call|tuple|functions|if> <nodes>\n",
+            argv[0]);
+    return 1;
+  }
+
+  std::size_t const size = strtoull(argv[2], nullptr, 10);
+
+  void (*gen)(std::size_t) = nullptr;
+  if (!strcmp(argv[1], "let"))
+    gen = genLet;
+  else if (!strcmp(argv[1], "call"))
+    gen = genCall;
+  else if (!strcmp(argv[1], "tuple"))
+    gen = genTuple;
+  else if (!strcmp(argv[1], "functions"))
+    gen = genFunctions;
+  else if (!strcmp(argv[1], "if"))
+    gen = genIf;
+  else {
+    fprintf(stderr, "unknown shape %s\n", argv[1]);
+    return 1;
+  }
+
+  printf(R"({"name":"gen.rinha","expression":)");
+  gen(size);
+  printf(",%s}\n", location);
+
+  fprintf(stderr, "%zu\n", nodes);
+  return 0;
+}
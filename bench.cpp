@@ -0,0 +1,332 @@
+// Microbenchmarks of the compiler's hot paths and of the primitives the C++
+// runner is built from, to check optimizations to them and catch
+// regressions.
+//
+// Usage: cpp-rinher-bench [filter]
+//
+// Runs every benchmark whose name contains filter, at each size, and prints
+// how long it took per node (or per operation, for the runtime primitives).
+
+#include <chrono>
+#include <cstdio>
+#include <fcntl.h>
+#include <fstream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "ast_internal.h"
+#include "llvm.h"
+#include "out.h"
+
+namespace {
+
+constexpr std::size_t sizes[] = {1'000, 10'000, 100'000};
+
+// Keeps the compiler from optimizing away what is being measured
+template <typename T> void keep(const T &value) {
+  asm volatile("" : : "g"(&value) : "memory");
+}
+
+// Average time of a call to f in ns, repeating it for at least 100ms
+template <typename F> double measure(F &&f) {
+  using Clock = std::chrono::steady_clock;
+  f();
+
+  std::size_t runs = 0;
+  auto const start = Clock::now();
+  auto elapsed = Clock::duration::zero();
+  do {
+    f();
+    runs++;
+    elapsed = Clock::now() - start;
+  } while (elapsed < std::chrono::milliseconds(100));
+
+  return std::chrono::duration<double, std::nano>(elapsed).count() / runs;
+}
+
+const char *filter = "";
+
+bool isSelected(const std::string &name) {
+  return name.find(filter) != std::string::npos;
+}
+
+void report(const std::string &name, std::size_t size, double ns,
+            const char *unit) {
+  printf("%-28s %8zu %10.1f ns/%s\n", name.c_str(), size, ns, unit);
+  fflush(stdout);
+}
+
+Json::Value makeLocation() {
+  Json::Value location;
+  location["start"] = 0;
+  location["end"] = 0;
+  location["filename"] = "bench.rinha";
+  return location;
+}
+
+Json::Value makeNode(const char *kind) {
+  Json::Value node;
+  node["kind"] = kind;
+  node["location"] = makeLocation();
+  return node;
+}
+
+Json::Value makeText(const std::string &text) {
+  Json::Value name;
+  name["text"] = text;
+  name["location"] = makeLocation();
+  return name;
+}
+
+Json::Value makeInt(int value) {
+  auto node = makeNode("Int");
+  node["value"] = value;
+  return node;
+}
+
+Json::Value makeVar(const std::string &name) {
+  auto node = makeNode("Var");
+  node["text"] = name;
+  return node;
+}
+
+std::string getName(std::size_t i) { return "x" + std::to_string(i); }
+
+// The value bound to x<i>, out of x<i - 1>, mostly made of the kind the
+// program is named after
+using MakeValue = Json::Value (*)(std::size_t i);
+
+struct Program {
+  const char *name;
+  MakeValue makeValue;
+};
+
+const Program programs[] = {
+    {"int", [](std::size_t i) { return makeInt(i); }},
+    {"str",
+     [](std::size_t i) {
+       auto node = makeNode("Str");
+       node["value"] = "s" + std::to_string(i);
+       return node;
+     }},
+    {"binary",
+     [](std::size_t i) {
+       auto node = makeNode("Binary");
+       node["lhs"] = makeVar(getName(i - 1));
+       node["op"] = "Add";
+       node["rhs"] = makeInt(1);
+       return node;
+     }},
+    {"tuple",
+     [](std::size_t i) {
+       auto node = makeNode("Tuple");
+       node["first"] = makeVar(getName(i - 1));
+       node["second"] = makeInt(1);
+       return node;
+     }},
+    {"print",
+     [](std::size_t i) {
+       auto node = makeNode("Print");
+       node["value"] = makeVar(getName(i - 1));
+       return node;
+     }},
+    {"if",
+     [](std::size_t i) {
+       auto node = makeNode("If");
+       node["condition"] = makeVar("c");
+       node["then"] = makeVar(getName(i - 1));
+       node["otherwise"] = makeInt(0);
+       return node;
+     }},
+    {"call",
+     [](std::size_t i) {
+       auto node = makeNode("Call");
+       node["callee"] = makeVar("f");
+       node["arguments"].append(makeVar(getName(i - 1)));
+       return node;
+     }},
+    {"function",
+     [](std::size_t i) {
+       auto body = makeNode("Binary");
+       body["lhs"] = makeVar("a");
+       body["op"] = "Add";
+       body["rhs"] = makeVar(getName(i - 1));
+
+       auto node = makeNode("Function");
+       node["parameters"].append(makeText("a"));
+       node["value"] = std::move(body);
+       return node;
+     }},
+};
+
+// let c = true; let f = fn (a) => a; let x0 = 0; let x1 = ...; print(xn)
+// The chain is built from its end, moving each let into the one before it
+Json::Value makeProgram(const Program &program, std::size_t size) {
+  auto next = makeNode("Print");
+  next["value"] = makeVar(getName(size));
+
+  auto const bind = [&](const std::string &name, Json::Value value) {
+    auto let = makeNode("Let");
+    let["name"] = makeText(name);
+    let["value"] = std::move(value);
+    let["next"].swap(next);
+    next.swap(let);
+  };
+
+  for (std::size_t i = size; i > 0; i--)
+    bind(getName(i), program.makeValue(i));
+  bind(getName(0), makeInt(0));
+
+  auto identity = makeNode("Function");
+  identity["parameters"].append(makeText("a"));
+  identity["value"] = makeVar("a");
+  bind("f", std::move(identity));
+
+  auto condition = makeNode("Bool");
+  condition["value"] = true;
+  bind("c", std::move(condition));
+  return next;
+}
+
+std::size_t countNodes(const Json::Value &root) {
+  std::size_t count = 0;
+  std::vector<const Json::Value *> pending{&root};
+  while (!pending.empty()) {
+    auto const *json = pending.back();
+    pending.pop_back();
+    count++;
+
+    std::vector<const Json::Value *> subterms;
+    appendSubtermsFromJson(*json, getTermKind(*json), subterms);
+    pending.insert(pending.end(), subterms.begin(), subterms.end());
+  }
+  return count;
+}
+
+// Parsing, lowering and each backend, per node of the program
+void benchCompiler() {
+  std::ofstream devNull("/dev/null");
+
+  for (auto const &program : programs) {
+    for (auto const size : sizes) {
+      std::string const suffix = std::string("/") + program.name;
+      if (!isSelected("ast" + suffix) && !isSelected("ir" + suffix) &&
+          !isSelected("cpp" + suffix) && !isSelected("julia" + suffix) &&
+          !isSelected("llvm" + suffix))
+        continue;
+
+      auto const json = makeProgram(program, size);
+      double const nodes = countNodes(json);
+
+      if (isSelected("ast" + suffix))
+        report("ast" + suffix, size,
+               measure([&] { keep(createTermFromJson(json)); }) / nodes,
+               "node");
+
+      auto const ast = createTermFromJson(json);
+      if (isSelected("ir" + suffix))
+        report("ir" + suffix, size,
+               measure([&] { keep(Ir::lower(ast)); }) / nodes, "node");
+
+      auto const module = Ir::lower(ast);
+      if (isSelected("cpp" + suffix))
+        report("cpp" + suffix, size,
+               measure([&] { writeCpp(module, devNull); }) / nodes, "node");
+      if (isSelected("julia" + suffix))
+        report("julia" + suffix, size,
+               measure([&] { writeJulia(ast, devNull); }) / nodes, "node");
+      if (isSelected("llvm" + suffix))
+        report("llvm" + suffix, size,
+               measure([&] { keep(Llvm::emit(module)); }) / nodes, "node");
+    }
+  }
+}
+
+void benchLookup() {
+  if (!isSelected("lookup/termLookupTable"))
+    return;
+
+  std::vector<std::string> kinds;
+  for (auto const &[kind, _] : termLookupTable)
+    kinds.push_back(kind);
+
+  for (auto const size : sizes) {
+    double const ns = measure([&] {
+      for (std::size_t i = 0; i < size; i++)
+        keep(termLookupTable.find(kinds[i % kinds.size()]));
+    });
+    report("lookup/termLookupTable", size, ns / size, "op");
+  }
+}
+
+// Strings of size characters, concatenated and printed size times
+void benchRuntime() {
+  constexpr std::size_t ops = 1'000;
+
+  for (std::size_t const length : {16, 256, 4096}) {
+    std::string const lhs(length, 'a'), rhs(length, 'b');
+
+    if (isSelected("out.h/__add_impl(str,str)"))
+      report("out.h/__add_impl(str,str)", length, measure([&] {
+               for (std::size_t i = 0; i < ops; i++)
+                 keep(__add_impl(lhs, rhs));
+             }) / ops,
+             "op");
+
+    if (isSelected("out.h/__add_impl(str,int)"))
+      report("out.h/__add_impl(str,int)", length, measure([&] {
+               for (std::size_t i = 0; i < ops; i++)
+                 keep(__add_impl(lhs, static_cast<int>(i)));
+             }) / ops,
+             "op");
+  }
+
+  // What is printed goes to /dev/null, the report to the real stdout
+  fflush(stdout);
+  int const out = dup(STDOUT_FILENO);
+  int const devNull = open("/dev/null", O_WRONLY);
+  auto const measurePrint = [&](auto &&f) {
+    dup2(devNull, STDOUT_FILENO);
+    double const ns = measure([&] {
+      for (std::size_t i = 0; i < ops; i++)
+        f(i);
+      fflush(stdout);
+    });
+    dup2(out, STDOUT_FILENO);
+    return ns / ops;
+  };
+
+  if (isSelected("out.h/print(int)"))
+    report("out.h/print(int)", ops, measurePrint([](std::size_t i) {
+             keep(print(static_cast<int>(i)));
+           }),
+           "op");
+
+  for (std::size_t const length : {16, 256, 4096}) {
+    std::string const str(length, 'a');
+    if (isSelected("out.h/print(str)"))
+      report("out.h/print(str)", length,
+             measurePrint([&](std::size_t) { keep(print(str)); }), "op");
+  }
+
+  close(devNull);
+  close(out);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  if (argc > 1)
+    filter = argv[1];
+
+  printf("%-28s %8s %10s\n", "benchmark", "size", "time");
+
+  // Deep programs are built and freed recursively by jsoncpp
+  runWithStack(1u << 30, [] {
+    benchCompiler();
+    benchLookup();
+    benchRuntime();
+  });
+  return 0;
+}
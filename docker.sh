@@ -1,3 +1,3 @@
 docker buildx build --platform linux/amd64 -f ./Dockerfile -t jsc-rinher .
 
-docker run -v $(pwd)/$1:/var/rinha/source.rinha.json --memory=2gb --cpus=2 jsc-rinher
+docker run -v $(pwd)/$1:/var/rinha/source.rinha.json -v rinha-cache:/cache -e RINHA_CACHE_PERSISTENT=1 --memory=2gb --cpus=2 jsc-rinher
@@ -0,0 +1,663 @@
+#include <chrono>
+#include <climits>
+#include <memory>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "eval.h"
+
+namespace {
+
+struct TupleValue;
+struct ClosureValue;
+struct Frame;
+
+using Env = std::shared_ptr<Frame>;
+
+struct Value {
+  enum Kind { Int, Str, Bool, Tuple, Closure };
+
+  Kind kind = Int;
+  int32_t number{};
+  std::shared_ptr<const std::string> str{};
+  std::shared_ptr<TupleValue> tuple{};
+  std::shared_ptr<const ClosureValue> closure{};
+};
+
+struct TupleValue {
+  Value first, second;
+
+  // Like bindings, tuples only held by this one are released one at a time,
+  // since programs can nest them as deep as they like
+  ~TupleValue() {
+    std::vector<std::shared_ptr<TupleValue>> pending;
+    auto const release = [&](Value &value) {
+      if (value.tuple && value.tuple.use_count() == 1)
+        pending.push_back(std::move(value.tuple));
+    };
+
+    release(first);
+    release(second);
+    while (!pending.empty()) {
+      auto tuple = std::move(pending.back());
+      pending.pop_back();
+      release(tuple->first);
+      release(tuple->second);
+    }
+  }
+};
+
+struct ClosureValue {
+  const Ast::Function *function;
+  Env env;
+};
+
+// The variables of one call of a function: its parameters, then the lets of
+// its body. Functions see those of the function they were written in through
+// parent
+struct Frame {
+  std::vector<Value> slots;
+  Env parent;
+
+  // Parents only held by this frame are released one at a time, since
+  // dropping them recursively would take a stack frame per level
+  ~Frame() {
+    while (parent && parent.use_count() == 1)
+      parent = std::move(parent->parent);
+  }
+};
+
+// Where a variable lives: slot index of the frame hops parents up. Lets are
+// resolved to the slot they bind, and functions to the number of slots their
+// frames have
+struct Slot {
+  uint32_t hops, index;
+};
+
+using Slots = std::unordered_map<const Ast::Node *, Slot>;
+
+// Resolves every variable of the program to its slot ahead of time, so
+// looking one up doesn't depend on how many variables are in scope
+class Resolver {
+public:
+  explicit Resolver(Slots &slots) : slots(slots) {}
+
+  // Resolves the top level of the program, which runs in a frame of its own
+  uint32_t resolveProgram(const Ast::Node *program) {
+    resolve(program);
+    return size;
+  }
+
+private:
+  Slots &slots;
+
+  // Slots of the variables in scope by name, the innermost binding last,
+  // with the level of the function that binds them as hops
+  std::unordered_map<std::string_view, std::vector<Slot>> bindings;
+  // Names in the order they were bound, to unbind them when their let ends
+  std::vector<std::string_view> bound;
+
+  // How deep the function being resolved is, and how many slots it has
+  uint32_t level = 0, size = 0;
+
+  uint32_t bind(std::string_view name) {
+    bindings[name].push_back({level, size});
+    bound.push_back(name);
+    return size++;
+  }
+
+  void unbind(std::size_t base) {
+    for (; bound.size() > base; bound.pop_back())
+      bindings[bound.back()].pop_back();
+  }
+
+  void resolveFunction(const Ast::Function *f) {
+    auto const outerSize = size;
+    auto const base = bound.size();
+
+    level++;
+    size = 0;
+    for (auto const &parameter : f->parameters)
+      bind(parameter);
+    resolve(f->value.get());
+    slots[f] = {0, size};
+    level--;
+
+    size = outerSize;
+    unbind(base);
+  }
+
+  // Lets in a chain are resolved in this loop, and stay bound until the
+  // chain ends
+  void resolve(const Ast::Node *term) {
+    auto const base = bound.size();
+    for (;;) {
+      switch (term->kind) {
+      case Ast::VarKind: {
+        auto const &found =
+            bindings[static_cast<const Ast::Var *>(term)->text];
+        if (!found.empty())
+          slots[term] = {level - found.back().hops, found.back().index};
+        break;
+      }
+
+      case Ast::LetKind: {
+        // Functions are bound before their body so they can call themselves
+        auto const *let = static_cast<const Ast::Let *>(term);
+        if (let->value->kind == Ast::FunctionKind) {
+          slots[let] = {0, bind(let->name)};
+          resolveFunction(static_cast<const Ast::Function *>(let->value.get()));
+        } else {
+          resolve(let->value.get());
+          slots[let] = {0, bind(let->name)};
+        }
+        term = let->next.get();
+        continue;
+      }
+
+      case Ast::FunctionKind:
+        resolveFunction(static_cast<const Ast::Function *>(term));
+        break;
+
+      case Ast::CallKind: {
+        auto const *c = static_cast<const Ast::Call *>(term);
+        resolve(c->callee.get());
+        for (auto const &argument : c->arguments)
+          resolve(argument.get());
+        break;
+      }
+
+      case Ast::BinaryKind: {
+        auto const *b = static_cast<const Ast::Binary *>(term);
+        resolve(b->lhs.get());
+        resolve(b->rhs.get());
+        break;
+      }
+
+      case Ast::TupleKind: {
+        auto const *t = static_cast<const Ast::Tuple *>(term);
+        resolve(t->first.get());
+        resolve(t->second.get());
+        break;
+      }
+
+      case Ast::IfKind: {
+        auto const *i = static_cast<const Ast::If *>(term);
+        resolve(i->condition.get());
+        resolve(i->then.get());
+        resolve(i->otherwise.get());
+        break;
+      }
+
+      case Ast::PrintKind:
+        resolve(static_cast<const Ast::Print *>(term)->value.get());
+        break;
+      case Ast::FirstKind:
+        resolve(static_cast<const Ast::First *>(term)->value.get());
+        break;
+      case Ast::SecondKind:
+        resolve(static_cast<const Ast::Second *>(term)->value.get());
+        break;
+
+      default:
+        break;
+      }
+      break;
+    }
+    unbind(base);
+  }
+};
+
+Value makeInt(int32_t number) { return {Value::Int, number}; }
+
+Value makeBool(bool boolean) { return {Value::Bool, boolean}; }
+
+// Rinha integers are 32 bits and wrap around
+int32_t wrap(int64_t number) {
+  return static_cast<int32_t>(static_cast<uint32_t>(number));
+}
+
+// Tuples are written from a stack of what is left to write, either a value
+// or the punctuation between its elements, instead of recursing on them
+void show(const Value &value, std::string &out) {
+  struct Item {
+    const Value *value;
+    const char *text;
+  };
+  std::vector<Item> stack{{&value, nullptr}};
+
+  while (!stack.empty()) {
+    auto const item = stack.back();
+    stack.pop_back();
+    if (item.text) {
+      out.append(item.text);
+      continue;
+    }
+
+    switch (item.value->kind) {
+    case Value::Int:
+      out.append(std::to_string(item.value->number));
+      break;
+    case Value::Str:
+      out.append(*item.value->str);
+      break;
+    case Value::Bool:
+      out.append(item.value->number ? "true" : "false");
+      break;
+    case Value::Tuple:
+      out.append("(");
+      stack.push_back({nullptr, ")"});
+      stack.push_back({&item.value->tuple->second, nullptr});
+      stack.push_back({nullptr, ", "});
+      stack.push_back({&item.value->tuple->first, nullptr});
+      break;
+    case Value::Closure:
+      out.append("<#closure>");
+      break;
+    }
+  }
+}
+
+// Turns a value back into a term, if it is a constant. Tuples nested deeper
+// than depth are not, so the residual program is never deeper than the
+// interpreter itself may go
+Ast::Term reify(const Value &value, uint32_t depth) {
+  switch (value.kind) {
+  case Value::Int:
+    return std::make_unique<Ast::Int>(value.number);
+  case Value::Str:
+    return std::make_unique<Ast::Str>(std::string(*value.str));
+  case Value::Bool:
+    return std::make_unique<Ast::Bool>(value.number);
+  case Value::Tuple: {
+    if (!depth)
+      return nullptr;
+    auto first = reify(value.tuple->first, depth - 1);
+    auto second = reify(value.tuple->second, depth - 1);
+    if (!first || !second)
+      return nullptr;
+    return std::make_unique<Ast::Tuple>(std::move(first), std::move(second));
+  }
+  case Value::Closure:
+    return nullptr;
+  }
+  __builtin_unreachable();
+}
+
+class Interpreter {
+public:
+  Interpreter(const Eval::Budget &budget, const Slots &slots)
+      : budget(budget), slots(slots),
+        deadline(Clock::now() + std::chrono::milliseconds(budget.milliseconds)) {
+  }
+
+  std::string output;
+
+  // Evaluates the let's value into its slot of env. Functions are bound
+  // before they are created, so they can call themselves
+  bool bind(const Ast::Let *let, const Env &env) {
+    auto &slot = bound(let, env);
+    if (let->value->kind == Ast::FunctionKind) {
+      if (!spend(sizeof(ClosureValue)))
+        return false;
+      slot = {Value::Closure};
+      slot.closure = std::make_shared<ClosureValue>(ClosureValue{
+          static_cast<const Ast::Function *>(let->value.get()), env});
+      return true;
+    }
+
+    return nested(let->value, env, slot);
+  }
+
+  // The slot of env that the let binds
+  Value &bound(const Ast::Let *let, const Env &env) {
+    return env->slots[slots.at(let).index];
+  }
+
+  // Creates a frame for a call of f, or the top level when f is null
+  bool enter(const Ast::Node *f, Env parent, Env &frame) {
+    auto const size = slots.at(f).index;
+    if (!spend(sizeof(Frame) + size * sizeof(Value)))
+      return false;
+    frame = std::make_shared<Frame>(
+        Frame{std::vector<Value>(size), std::move(parent)});
+    return true;
+  }
+
+  bool eval(const Ast::Node *term, Env env, Value &out) {
+    // Lets, ifs and calls in tail position continue in this loop instead of
+    // recursing, so long programs and tail-recursive functions use no stack
+    for (;;) {
+      if (!budget.steps || (!(budget.steps & 4095) && Clock::now() > deadline))
+        return false;
+      budget.steps--;
+
+      switch (term->kind) {
+      case Ast::IntKind:
+        out = makeInt(static_cast<const Ast::Int *>(term)->value);
+        return true;
+
+      case Ast::BoolKind:
+        out = makeBool(static_cast<const Ast::Bool *>(term)->value);
+        return true;
+
+      case Ast::StrKind: {
+        auto const &str = static_cast<const Ast::Str *>(term)->value;
+        out = {Value::Str};
+        out.str = std::make_shared<const std::string>(str);
+        return spend(str.size());
+      }
+
+      case Ast::VarKind: {
+        auto const found = slots.find(term);
+        if (found == slots.end())
+          return false;
+        auto const *frame = env.get();
+        for (auto hops = found->second.hops; hops; hops--)
+          frame = frame->parent.get();
+        out = frame->slots[found->second.index];
+        return true;
+      }
+
+      case Ast::TupleKind: {
+        auto const *t = static_cast<const Ast::Tuple *>(term);
+        Value first, second;
+        if (!nested(t->first, env, first) ||
+            !nested(t->second, env, second) || !spend(sizeof(TupleValue)))
+          return false;
+        out = {Value::Tuple};
+        out.tuple = std::make_shared<TupleValue>(
+            TupleValue{std::move(first), std::move(second)});
+        return true;
+      }
+
+      case Ast::FunctionKind:
+        if (!spend(sizeof(ClosureValue)))
+          return false;
+        out = {Value::Closure};
+        out.closure = std::make_shared<const ClosureValue>(
+            ClosureValue{static_cast<const Ast::Function *>(term), env});
+        return true;
+
+      case Ast::FirstKind:
+      case Ast::SecondKind: {
+        auto const &value = term->kind == Ast::FirstKind
+                                ? static_cast<const Ast::First *>(term)->value
+                                : static_cast<const Ast::Second *>(term)->value;
+        Value tuple;
+        if (!nested(value, env, tuple) || tuple.kind != Value::Tuple)
+          return false;
+        out = term->kind == Ast::FirstKind ? tuple.tuple->first
+                                           : tuple.tuple->second;
+        return true;
+      }
+
+      case Ast::PrintKind: {
+        if (!nested(static_cast<const Ast::Print *>(term)->value, env, out))
+          return false;
+        auto const before = output.size();
+        show(out, output);
+        output.append("\n");
+        return spend(output.size() - before);
+      }
+
+      case Ast::BinaryKind:
+        return binary(static_cast<const Ast::Binary *>(term), env, out);
+
+      case Ast::LetKind: {
+        auto const *let = static_cast<const Ast::Let *>(term);
+        if (!bind(let, env))
+          return false;
+        term = let->next.get();
+        continue;
+      }
+
+      case Ast::IfKind: {
+        auto const *i = static_cast<const Ast::If *>(term);
+        Value condition;
+        if (!nested(i->condition, env, condition) ||
+            condition.kind != Value::Bool)
+          return false;
+        term = condition.number ? i->then.get() : i->otherwise.get();
+        continue;
+      }
+
+      case Ast::CallKind: {
+        auto const *c = static_cast<const Ast::Call *>(term);
+        Value callee;
+        if (!nested(c->callee, env, callee) ||
+            callee.kind != Value::Closure)
+          return false;
+
+        auto const *f = callee.closure->function;
+        if (f->parameters.size() != c->arguments.size())
+          return false;
+
+        Env frame;
+        if (!enter(f, callee.closure->env, frame))
+          return false;
+        for (std::size_t i = 0; i < c->arguments.size(); i++)
+          if (!nested(c->arguments[i], env, frame->slots[i]))
+            return false;
+
+        term = f->value.get();
+        env = std::move(frame);
+        continue;
+      }
+
+      case Ast::ProgramKind:;
+      }
+
+      return false;
+    }
+  }
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  Eval::Budget budget;
+  const Slots &slots;
+  // Checked every few thousand steps, so a slow program gives up in time
+  Clock::time_point deadline;
+
+  bool spend(uint64_t bytes) {
+    if (bytes > budget.bytes)
+      return false;
+    budget.bytes -= bytes;
+    return true;
+  }
+
+  // Subterms not in tail position are evaluated by a nested call, which is
+  // where the depth of the program turns into depth of the interpreter
+  bool nested(const Ast::Term &term, const Env &env, Value &out) {
+    if (!budget.depth)
+      return false;
+    budget.depth--;
+    bool const ok = eval(term.get(), env, out);
+    budget.depth++;
+    return ok;
+  }
+
+  bool binary(const Ast::Binary *b, const Env &env, Value &out) {
+    Value lhs, rhs;
+    if (!nested(b->lhs, env, lhs))
+      return false;
+
+    if (b->op == Ast::And || b->op == Ast::Or) {
+      if (lhs.kind != Value::Bool)
+        return false;
+      if (lhs.number == (b->op == Ast::Or)) {
+        out = lhs;
+        return true;
+      }
+      if (!nested(b->rhs, env, rhs) || rhs.kind != Value::Bool)
+        return false;
+      out = rhs;
+      return true;
+    }
+
+    if (!nested(b->rhs, env, rhs))
+      return false;
+
+    if (b->op == Ast::Add && (lhs.kind == Value::Str ||
+                              rhs.kind == Value::Str)) {
+      if (lhs.kind == Value::Bool || lhs.kind == Value::Tuple ||
+          lhs.kind == Value::Closure || rhs.kind == Value::Bool ||
+          rhs.kind == Value::Tuple || rhs.kind == Value::Closure)
+        return false;
+      std::string str;
+      show(lhs, str);
+      show(rhs, str);
+      if (!spend(str.size()))
+        return false;
+      out = {Value::Str};
+      out.str = std::make_shared<const std::string>(std::move(str));
+      return true;
+    }
+
+    if (b->op == Ast::Eq || b->op == Ast::Neq) {
+      if (lhs.kind != rhs.kind)
+        return false;
+
+      bool equal;
+      switch (lhs.kind) {
+      case Value::Int:
+      case Value::Bool:
+        equal = lhs.number == rhs.number;
+        break;
+      case Value::Str:
+        equal = *lhs.str == *rhs.str;
+        break;
+      default:
+        return false;
+      }
+      out = makeBool(equal == (b->op == Ast::Eq));
+      return true;
+    }
+
+    if (lhs.kind != Value::Int || rhs.kind != Value::Int)
+      return false;
+
+    int64_t const l = lhs.number, r = rhs.number;
+    switch (b->op) {
+    case Ast::Add:
+      out = makeInt(wrap(l + r));
+      return true;
+    case Ast::Sub:
+      out = makeInt(wrap(l - r));
+      return true;
+    case Ast::Mul:
+      out = makeInt(wrap(l * r));
+      return true;
+    case Ast::Div:
+    case Ast::Rem:
+      // Left for the runner, which fails the same way it always did
+      if (r == 0 || (l == INT_MIN && r == -1))
+        return false;
+      out = makeInt(b->op == Ast::Div ? l / r : l % r);
+      return true;
+    case Ast::Lt:
+      out = makeBool(l < r);
+      return true;
+    case Ast::Gt:
+      out = makeBool(l > r);
+      return true;
+    case Ast::Lte:
+      out = makeBool(l <= r);
+      return true;
+    case Ast::Gte:
+      out = makeBool(l >= r);
+      return true;
+    default:
+      return false;
+    }
+  }
+};
+
+} // namespace
+
+namespace Eval {
+
+Result run(Ast::Term program, const Budget &budget) {
+  // The top level is entered like a function, with its size under null
+  Slots slots;
+  slots[nullptr] = {0, Resolver(slots).resolveProgram(program.get())};
+  Interpreter interpreter(budget, slots);
+  Result result;
+
+  // The top-level statements that ran, with the constant each one bound and
+  // how much had been printed before it
+  struct Statement {
+    Ast::Let *let;
+    Ast::Term constant;
+    std::size_t printed;
+  };
+  std::vector<Statement> ran;
+
+  Env env;
+  if (!interpreter.enter(nullptr, nullptr, env))
+    return {false, {}, std::move(program)};
+  Ast::Node *current = program.get();
+  std::size_t printed = 0;
+  while (current->kind == Ast::LetKind) {
+    auto *let = static_cast<Ast::Let *>(current);
+    printed = interpreter.output.size();
+    if (!interpreter.bind(let, env))
+      break;
+    ran.push_back(
+        {let, reify(interpreter.bound(let, env), budget.depth), printed});
+    current = let->next.get();
+  }
+
+  if (current->kind != Ast::LetKind) {
+    printed = interpreter.output.size();
+    Value value;
+    if (interpreter.eval(current, env, value)) {
+      result.complete = true;
+      result.output = std::move(interpreter.output);
+      return result;
+    }
+  }
+
+  // Statements that computed a closure can't be written back without
+  // running them again, so the residual program starts at the first one
+  std::size_t cut = 0;
+  while (cut < ran.size() &&
+         (ran[cut].constant || ran[cut].let->value->kind == Ast::FunctionKind))
+    cut++;
+  if (cut < ran.size())
+    printed = ran[cut].printed;
+
+  Ast::Term residual =
+      cut ? std::move(ran[cut - 1].let->next) : std::move(program);
+
+  for (std::size_t i = cut; i-- > 0;) {
+    auto *let = ran[i].let;
+    residual = std::make_unique<Ast::Let>(
+        std::string(let->name),
+        ran[i].constant ? std::move(ran[i].constant) : std::move(let->value),
+        std::move(residual));
+  }
+
+  // Everything printed so far is replayed by printing it as strings
+  std::vector<std::string_view> lines;
+  std::string_view output(interpreter.output.data(), printed);
+  while (!output.empty()) {
+    auto const end = output.find('\n');
+    lines.push_back(output.substr(0, end));
+    output.remove_prefix(end + 1);
+  }
+
+  for (std::size_t i = lines.size(); i-- > 0;)
+    residual = std::make_unique<Ast::Let>(
+        "_",
+        std::make_unique<Ast::Print>(
+            std::make_unique<Ast::Str>(std::string(lines[i]))),
+        std::move(residual));
+
+  result.residual = std::move(residual);
+  return result;
+}
+
+} // namespace Eval
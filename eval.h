@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "ast.h"
+
+namespace Eval {
+
+struct Budget {
+  // Number of terms evaluated
+  uint64_t steps = 10'000'000;
+  // Bytes held by strings, tuples, closures and environments
+  uint64_t bytes = 256u << 20;
+  // Wall-clock time, for programs that are slow per step
+  uint64_t milliseconds = 200;
+  // Nested calls, bounded so the compiler's own stack can't overflow
+  uint32_t depth = 4096;
+};
+
+struct Result {
+  // Whether the whole program ran within the budget
+  bool complete = false;
+  // Everything the program printed, when complete
+  std::string output{};
+  // What is left to run when not complete: the statements that already ran
+  // are replaced by the prints they did and the constants they bound
+  Ast::Term residual{};
+};
+
+// Runs the program ahead of time. Anything the interpreter can't decide on
+// (type errors, division by zero, running out of budget) stops it, and the
+// rest of the program is left for the runner.
+Result run(Ast::Term program, const Budget &budget);
+
+} // namespace Eval
@@ -1,3 +1,25 @@
 #pragma once
 
-int generateFromJson(const char *pathToJson, const char* mode);
+#include <cstdint>
+
+struct GenerateOptions {
+  // Print time and peak memory of each phase to stderr
+  bool stats = false;
+
+  // Instrument every C++ function with call counts, cycles and recursion
+  // depth, reported by the runner when it exits
+  bool profile = false;
+  // Also write the IR the code is generated from to generated_main.ir
+  bool emitIr = false;
+
+  // Run the program in the compiler, within fuel steps, fuelBytes of memory
+  // and fuelMs milliseconds. If it finishes, the runner just writes its output (also left in
+  // generated_output.txt); otherwise the runner gets whatever is left of it
+  bool evaluate = false;
+  uint64_t fuel = 10'000'000;
+  uint64_t fuelBytes = 256u << 20;
+  uint64_t fuelMs = 200;
+};
+
+int generateFromJson(const char *pathToJson, const char *mode,
+                     const GenerateOptions &options = {});
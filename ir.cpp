@@ -0,0 +1,635 @@
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+
+#ifndef NDEBUG
+#include <iostream>
+#endif
+
+#include "ir.h"
+#include "utils.h"
+
+namespace {
+
+// Functions already in the module by their code, see Ir::Module. Without
+// merge, where a function was written is part of its code, so only the
+// same function is ever found
+struct FunctionIndex {
+  std::unordered_map<std::string, uint32_t> byCode;
+  bool merge;
+};
+
+std::string getOpName(Ast::BinaryOp op) {
+  switch (op) {
+  case Ast::Add:
+    return "add";
+  case Ast::Sub:
+    return "sub";
+  case Ast::Mul:
+    return "mul";
+  case Ast::Div:
+    return "div";
+  case Ast::Rem:
+    return "rem";
+  case Ast::Eq:
+    return "eq";
+  case Ast::Neq:
+    return "neq";
+  case Ast::Lt:
+    return "lt";
+  case Ast::Gt:
+    return "gt";
+  case Ast::Lte:
+    return "lte";
+  case Ast::Gte:
+    return "gte";
+  case Ast::And:
+    return "and";
+  case Ast::Or:
+    return "or";
+  }
+  __builtin_unreachable();
+}
+
+std::string getTypeName(Ir::Type type) {
+  switch (type) {
+  case Ir::UnknownType:
+    return "?";
+  case Ir::IntType:
+    return "int";
+  case Ir::StrType:
+    return "str";
+  case Ir::BoolType:
+    return "bool";
+  }
+  __builtin_unreachable();
+}
+
+std::string getValueName(Ir::Value value) {
+  return "%" + std::to_string(value);
+}
+
+void appendValues(const std::vector<Ir::Value> &values, std::string &out) {
+  for (std::size_t i = 0; i < values.size(); i++) {
+    if (i)
+      out.append(", ");
+    out.append(getValueName(values[i]));
+  }
+}
+
+void appendInstr(const Ir::Module &module, const Ir::Instr &instr,
+                 std::string &out) {
+  out.append("  ").append(getValueName(instr.result)).append(" = ");
+  switch (instr.op) {
+  case Ir::IntOp:
+    out.append("int ").append(std::to_string(instr.number));
+    break;
+  case Ir::BoolOp:
+    out.append(instr.number ? "bool true" : "bool false");
+    break;
+  case Ir::StrOp:
+    out.append("str ").append(getStringLiteral(instr.text, false));
+    break;
+  case Ir::BinaryOp:
+    out.append(getOpName(instr.binaryOp)).append(" ");
+    appendValues(instr.operands, out);
+    break;
+  case Ir::CallOp:
+    out.append("call ").append(getValueName(instr.operands[0])).append("(");
+    appendValues({instr.operands.begin() + 1, instr.operands.end()}, out);
+    out.append(")");
+    break;
+  case Ir::ClosureOp:
+    out.append("closure ")
+        .append(module.functions[instr.number].name)
+        .append("(");
+    appendValues(instr.operands, out);
+    out.append(")");
+    break;
+  case Ir::TupleOp:
+    out.append("tuple ");
+    appendValues(instr.operands, out);
+    break;
+  case Ir::FirstOp:
+    out.append("first ");
+    appendValues(instr.operands, out);
+    break;
+  case Ir::SecondOp:
+    out.append("second ");
+    appendValues(instr.operands, out);
+    break;
+  case Ir::PrintOp:
+    out.append("print ");
+    appendValues(instr.operands, out);
+    break;
+  case Ir::UnboundOp:
+    out.append("unbound ").append(instr.text);
+    break;
+  }
+  out.append("\n");
+}
+
+// Everything about a function but its names, so that functions that only
+// differ in the names of their variables print the same
+std::string getFunctionCode(const Ir::Module &module, const Ir::Function &f) {
+  std::string out = "fn(";
+  appendValues(f.parameters, out);
+  out.append(")");
+
+  if (f.self != Ir::NoValue)
+    out.append(" self ").append(getValueName(f.self));
+
+  // Captures keep the type they had outside, which the code depends on
+  if (!f.captures.empty()) {
+    out.append(" captures ");
+    for (std::size_t i = 0; i < f.captures.size(); i++) {
+      if (i)
+        out.append(", ");
+      out.append(getValueName(f.captures[i]))
+          .append(": ")
+          .append(getTypeName(f.types[f.captures[i]]));
+    }
+  }
+  out.append(" {\n");
+
+  for (std::size_t b = 0; b < f.blocks.size(); b++) {
+    auto const &block = f.blocks[b];
+    out.append("b").append(std::to_string(b));
+    if (block.parameter != Ir::NoValue)
+      out.append("(").append(getValueName(block.parameter)).append(")");
+    out.append(":\n");
+
+    for (auto const &instr : block.instrs)
+      appendInstr(module, instr, out);
+
+    auto const &terminator = block.terminator;
+    switch (terminator.kind) {
+    case Ir::ReturnKind:
+      out.append("  ret ").append(getValueName(terminator.value));
+      break;
+    case Ir::JumpKind:
+      out.append("  jump b")
+          .append(std::to_string(terminator.target))
+          .append("(")
+          .append(getValueName(terminator.value))
+          .append(")");
+      break;
+    case Ir::BranchKind:
+      out.append("  br ")
+          .append(getValueName(terminator.value))
+          .append(", b")
+          .append(std::to_string(terminator.target))
+          .append(", b")
+          .append(std::to_string(terminator.otherwise));
+      if (terminator.join != Ir::NoBlock)
+        out.append(", join b").append(std::to_string(terminator.join));
+      break;
+    }
+    out.append("\n");
+  }
+
+  return out.append("}\n");
+}
+
+// Lowers the body of one function. Variables of enclosing functions are
+// looked up through outer, and become captures of this one
+class FunctionLowering {
+public:
+  FunctionLowering(Ir::Module &module, FunctionIndex &index,
+                   FunctionLowering *outer)
+      : module(module), index(index), outer(outer) {
+    newBlock();
+  }
+
+  Ir::Function function;
+
+  // Values of the enclosing function to create the closure with, in the
+  // same order as function.captures
+  std::vector<Ir::Value> captured;
+
+  Ir::Value newValue(Ir::Type type) {
+    function.types.push_back(type);
+    return function.types.size() - 1;
+  }
+
+  // Lowers term into the current block. In tail position its value is
+  // returned from the function and NoValue is returned
+  Ir::Value lower(const Ast::Node *term, bool tail) {
+    switch (term->kind) {
+    // Lets are lowered in a loop, since programs are long chains of them
+    case Ast::LetKind: {
+      std::size_t const base = bound.size();
+      while (term->kind == Ast::LetKind) {
+        auto const *let = static_cast<const Ast::Let *>(term);
+        Ir::Value const value =
+            let->value->kind == Ast::FunctionKind
+                ? lowerFunction(
+                      static_cast<const Ast::Function *>(let->value.get()),
+                      let->name)
+                : lower(let->value.get(), false);
+        bind(let->name, value);
+        term = let->next.get();
+      }
+
+      Ir::Value const value = lower(term, tail);
+      unbind(base);
+      return value;
+    }
+
+    case Ast::IfKind: {
+      auto const *i = static_cast<const Ast::If *>(term);
+      return branch(
+          lower(i->condition.get(), false), tail,
+          [&] { return lower(i->then.get(), tail); },
+          [&] { return lower(i->otherwise.get(), tail); });
+    }
+
+    default:
+      break;
+    }
+
+    Ir::Value const value = lowerValue(term);
+    if (!tail)
+      return value;
+
+    terminate({Ir::ReturnKind, value});
+    return Ir::NoValue;
+  }
+
+  // Lowers the program or the body of a function, ending with its value
+  void lowerBody(const Ast::Node *term) { lower(term, true); }
+
+private:
+  Ir::Module &module;
+  FunctionIndex &index;
+  FunctionLowering *outer;
+
+  // Variables in scope by name, the innermost binding last. Variables of
+  // enclosing functions are added at the bottom once captured
+  std::unordered_map<std::string_view, std::vector<Ir::Value>> bindings;
+
+  // Names in the order they were bound, to unbind them when their let ends
+  std::vector<std::string_view> bound;
+
+  void bind(std::string_view name, Ir::Value value) {
+    bindings[name].push_back(value);
+    bound.push_back(name);
+  }
+
+  void unbind(std::size_t base) {
+    for (; bound.size() > base; bound.pop_back())
+      bindings[bound.back()].pop_back();
+  }
+
+  // Block instructions are being added to
+  Ir::BlockId current = 0;
+
+  Ir::BlockId newBlock() {
+    function.blocks.emplace_back();
+    return function.blocks.size() - 1;
+  }
+
+  Ir::Value add(Ir::Instr instr, Ir::Type type) {
+    instr.result = newValue(type);
+    function.blocks[current].instrs.push_back(std::move(instr));
+    return function.blocks[current].instrs.back().result;
+  }
+
+  void terminate(Ir::Terminator terminator) {
+    function.blocks[current].terminator = terminator;
+  }
+
+  Ir::Value constant(Ir::Op op, int32_t number, Ir::Type type) {
+    Ir::Instr instr{op};
+    instr.number = number;
+    return add(std::move(instr), type);
+  }
+
+  // print returns its argument, so it also has its type
+  Ir::Value unary(Ir::Op op, const Ast::Node *term) {
+    Ir::Value const operand = lower(term, false);
+    return add({op, Ir::NoValue, {operand}},
+               op == Ir::PrintOp ? function.types[operand] : Ir::UnknownType);
+  }
+
+  // Ends the current block with a branch on condition, and lowers each arm
+  // into its own block. Unless in tail position, the arms jump to a new
+  // block that takes the value of the arm as its parameter
+  template <typename Then, typename Otherwise>
+  Ir::Value branch(Ir::Value condition, bool tail, Then &&then,
+                   Otherwise &&otherwise) {
+    Ir::BlockId const thenBlock = newBlock();
+    Ir::BlockId const otherwiseBlock = newBlock();
+    Ir::BlockId const join = tail ? Ir::NoBlock : newBlock();
+    terminate({Ir::BranchKind, condition, thenBlock, otherwiseBlock, join});
+
+    current = thenBlock;
+    Ir::Value const thenValue = then();
+    if (!tail)
+      terminate({Ir::JumpKind, thenValue, join});
+
+    current = otherwiseBlock;
+    Ir::Value const otherwiseValue = otherwise();
+    if (tail)
+      return Ir::NoValue;
+    terminate({Ir::JumpKind, otherwiseValue, join});
+
+    Ir::Type const type =
+        function.types[thenValue] == function.types[otherwiseValue]
+            ? function.types[thenValue]
+            : Ir::UnknownType;
+
+    current = join;
+    function.blocks[join].parameter = newValue(type);
+    return function.blocks[join].parameter;
+  }
+
+  // A bool out of an operand of && or ||, which must be one
+  Ir::Value lowerBool(const Ast::Node *term) {
+    Ir::Value const value = lower(term, false);
+    if (function.types[value] == Ir::BoolType)
+      return value;
+
+    return branch(
+        value, false,
+        [&] { return constant(Ir::BoolOp, true, Ir::BoolType); },
+        [&] { return constant(Ir::BoolOp, false, Ir::BoolType); });
+  }
+
+  Ir::Value lookup(std::string_view name) {
+    auto &values = bindings[name];
+    if (!values.empty())
+      return values.back();
+
+    if (!outer)
+      return Ir::NoValue;
+
+    Ir::Value const outerValue = outer->lookup(name);
+    if (outerValue == Ir::NoValue)
+      return Ir::NoValue;
+
+    // Values are immutable, so a capture has the type of what it captured
+    Ir::Value const value = newValue(outer->function.types[outerValue]);
+    function.captures.push_back(value);
+    captured.push_back(outerValue);
+    values.push_back(value);
+    return value;
+  }
+
+  Ir::Value lowerFunction(const Ast::Function *f, std::string_view self) {
+    FunctionLowering inner(module, index, this);
+    inner.function.source = self;
+    inner.function.location = f->location;
+
+    if (!self.empty()) {
+      inner.function.self = inner.newValue(Ir::UnknownType);
+      inner.bind(self, inner.function.self);
+    }
+
+    for (auto const &parameter : f->parameters) {
+      Ir::Value const value = inner.newValue(Ir::UnknownType);
+      inner.function.parameters.push_back(value);
+      inner.bind(parameter, value);
+    }
+
+    inner.lowerBody(f->value.get());
+
+    Ir::Instr closure{Ir::ClosureOp, Ir::NoValue, std::move(inner.captured)};
+    closure.number = addFunction(module, index, std::move(inner.function));
+    return add(std::move(closure), Ir::UnknownType);
+  }
+
+  Ir::Value lowerValue(const Ast::Node *term) {
+    switch (term->kind) {
+    case Ast::IntKind:
+      return constant(Ir::IntOp, static_cast<const Ast::Int *>(term)->value,
+                      Ir::IntType);
+
+    case Ast::BoolKind:
+      return constant(Ir::BoolOp, static_cast<const Ast::Bool *>(term)->value,
+                      Ir::BoolType);
+
+    case Ast::StrKind: {
+      Ir::Instr instr{Ir::StrOp};
+      instr.text = static_cast<const Ast::Str *>(term)->value;
+      return add(std::move(instr), Ir::StrType);
+    }
+
+    case Ast::VarKind: {
+      auto const &text = static_cast<const Ast::Var *>(term)->text;
+      Ir::Value const value = lookup(text);
+      if (value != Ir::NoValue)
+        return value;
+
+      Ir::Instr instr{Ir::UnboundOp};
+      instr.text = text;
+      return add(std::move(instr), Ir::UnknownType);
+    }
+
+    case Ast::BinaryKind: {
+      auto const *b = static_cast<const Ast::Binary *>(term);
+
+      // Only evaluates the rhs when needed: a && b is if a { b } else false
+      if (b->op == Ast::And || b->op == Ast::Or) {
+        bool const isAnd = b->op == Ast::And;
+        return branch(
+            lowerBool(b->lhs.get()), false,
+            [&] {
+              return isAnd ? lowerBool(b->rhs.get())
+                           : constant(Ir::BoolOp, true, Ir::BoolType);
+            },
+            [&] {
+              return isAnd ? constant(Ir::BoolOp, false, Ir::BoolType)
+                           : lowerBool(b->rhs.get());
+            });
+      }
+
+      Ir::Value const lhs = lower(b->lhs.get(), false);
+      Ir::Value const rhs = lower(b->rhs.get(), false);
+      Ir::Instr instr{Ir::BinaryOp, Ir::NoValue, {lhs, rhs}};
+      instr.binaryOp = b->op;
+      return add(std::move(instr),
+                 Ir::getBinaryType(b->op, function.types[lhs],
+                                   function.types[rhs]));
+    }
+
+    case Ast::CallKind: {
+      auto const *c = static_cast<const Ast::Call *>(term);
+      Ir::Instr instr{Ir::CallOp, Ir::NoValue, {lower(c->callee.get(), false)}};
+      for (auto const &argument : c->arguments)
+        instr.operands.push_back(lower(argument.get(), false));
+      return add(std::move(instr), Ir::UnknownType);
+    }
+
+    case Ast::FunctionKind:
+      return lowerFunction(static_cast<const Ast::Function *>(term), {});
+
+    case Ast::TupleKind: {
+      auto const *t = static_cast<const Ast::Tuple *>(term);
+      Ir::Value const first = lower(t->first.get(), false);
+      Ir::Value const second = lower(t->second.get(), false);
+      return add({Ir::TupleOp, Ir::NoValue, {first, second}},
+                 Ir::UnknownType);
+    }
+
+    case Ast::PrintKind:
+      return unary(Ir::PrintOp,
+                   static_cast<const Ast::Print *>(term)->value.get());
+
+    case Ast::FirstKind:
+      return unary(Ir::FirstOp,
+                   static_cast<const Ast::First *>(term)->value.get());
+
+    case Ast::SecondKind:
+      return unary(Ir::SecondOp,
+                   static_cast<const Ast::Second *>(term)->value.get());
+
+    default:
+      break;
+    }
+
+    ABORT(std::string("Missing support for term ")
+              .append(std::to_string(term->kind)));
+    __builtin_unreachable();
+  }
+
+public:
+  // Adds f to the module, unless a function with the same code is already
+  // there, and returns its number
+  static uint32_t addFunction(Ir::Module &module, FunctionIndex &index,
+                              Ir::Function f) {
+    std::string code = getFunctionCode(module, f);
+    if (!index.merge)
+      code.append("; ")
+          .append(f.source)
+          .append(" at ")
+          .append(f.location.filename)
+          .append(":")
+          .append(std::to_string(f.location.start))
+          .append("-")
+          .append(std::to_string(f.location.end));
+
+    auto const found = index.byCode.find(code);
+    if (found != index.byCode.end())
+      return found->second;
+
+    char name[32];
+    snprintf(name, sizeof(name), "__fn_%016llx",
+             static_cast<unsigned long long>(hash_string(code)));
+    f.name = name;
+
+    module.functions.push_back(std::move(f));
+    index.byCode.emplace(std::move(code), module.functions.size() - 1);
+    return module.functions.size() - 1;
+  }
+};
+
+enum Use : uint8_t { TakenApart = 1, Called = 2, Escapes = 4 };
+
+// How f uses each of its values
+std::vector<uint8_t> getUses(const Ir::Function &f) {
+  std::vector<uint8_t> uses(f.types.size(), 0);
+  for (auto const &block : f.blocks) {
+    for (auto const &instr : block.instrs)
+      for (std::size_t i = 0; i < instr.operands.size(); i++) {
+        Use use = Escapes;
+        if (instr.op == Ir::FirstOp || instr.op == Ir::SecondOp)
+          use = TakenApart;
+        else if (instr.op == Ir::CallOp && i == 0)
+          use = Called;
+        uses[instr.operands[i]] |= use;
+      }
+
+    if (block.terminator.value != Ir::NoValue)
+      uses[block.terminator.value] |= Escapes;
+  }
+  return uses;
+}
+
+} // namespace
+
+namespace Ir {
+
+Type getBinaryType(Ast::BinaryOp op, Type lhs, Type rhs) {
+  switch (op) {
+  case Ast::Add:
+    if (lhs == IntType && rhs == IntType)
+      return IntType;
+    if ((lhs == StrType && (rhs == StrType || rhs == IntType)) ||
+        (lhs == IntType && rhs == StrType))
+      return StrType;
+    return UnknownType;
+  case Ast::Sub:
+  case Ast::Mul:
+  case Ast::Div:
+  case Ast::Rem:
+    if (lhs == IntType && rhs == IntType)
+      return IntType;
+    return UnknownType;
+  default:
+    return BoolType;
+  }
+}
+
+Module lower(const Ast::Term &program, bool merge) {
+  Module module;
+  FunctionIndex index{{}, merge};
+
+  FunctionLowering main(module, index, nullptr);
+  main.lowerBody(program.get());
+  main.function.name = "main";
+  module.functions.push_back(std::move(main.function));
+  return module;
+}
+
+std::vector<const Instr *> getDefinitions(const Function &f) {
+  std::vector<const Instr *> definitions(f.types.size(), nullptr);
+  for (auto const &block : f.blocks)
+    for (auto const &instr : block.instrs)
+      definitions[instr.result] = &instr;
+  return definitions;
+}
+
+std::vector<bool> getEscapingSelves(const Module &module) {
+  std::vector<bool> escaping;
+  for (auto const &f : module.functions)
+    escaping.push_back(f.self != NoValue &&
+                       (getUses(f)[f.self] & (TakenApart | Escapes)));
+  return escaping;
+}
+
+std::vector<bool> getLocalObjects(const Function &f,
+                                  const std::vector<bool> &escapingSelves) {
+  auto const uses = getUses(f);
+  std::vector<bool> local(f.types.size(), false);
+  for (auto const &block : f.blocks)
+    for (auto const &instr : block.instrs) {
+      if (instr.op == TupleOp)
+        local[instr.result] = !(uses[instr.result] & (Called | Escapes));
+      else if (instr.op == ClosureOp && !instr.operands.empty())
+        local[instr.result] = !(uses[instr.result] & (TakenApart | Escapes)) &&
+                              !escapingSelves[instr.number];
+    }
+  return local;
+}
+
+std::string print(const Module &module) {
+  std::string out;
+  for (auto const &f : module.functions) {
+    if (&f != &module.functions.back())
+      out.append("; ")
+          .append(f.source.empty() ? "<anonymous>" : f.source)
+          .append(" at ")
+          .append(f.location.filename)
+          .append(":")
+          .append(std::to_string(f.location.start))
+          .append("\n");
+    out.append(f.name)
+        .append(" ")
+        .append(getFunctionCode(module, f))
+        .append("\n");
+  }
+  return out;
+}
+
+} // namespace Ir
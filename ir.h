@@ -0,0 +1,131 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "ast.h"
+
+// A flat representation of the program, lowered once from the AST so that
+// analyses and backends don't each have to rebuild context from the tree.
+//
+// Every function is a list of basic blocks in A-normal form: each
+// instruction computes one temporary out of temporaries, and control only
+// flows through the block terminators. Temporaries are assigned once (SSA);
+// instead of phis, the block where both arms of a branch meet takes the
+// value of the arm that jumped to it as a parameter.
+namespace Ir {
+
+// A temporary, numbered per function
+using Value = uint32_t;
+constexpr Value NoValue = UINT32_MAX;
+
+using BlockId = uint32_t;
+constexpr BlockId NoBlock = UINT32_MAX;
+
+enum Op {
+  // number
+  IntOp,
+  // number
+  BoolOp,
+  // text
+  StrOp,
+  // binaryOp of operands[0] and operands[1], never And or Or: those branch
+  BinaryOp,
+  // operands[0] called with the rest of the operands
+  CallOp,
+  // Closure record of function number, with operands as its captures
+  ClosureOp,
+  TupleOp,
+  FirstOp,
+  SecondOp,
+  PrintOp,
+  // A variable the program never binds, named by text
+  UnboundOp,
+};
+
+enum Type { UnknownType, IntType, StrType, BoolType };
+
+struct Instr {
+  Op op;
+  Value result = NoValue;
+  std::vector<Value> operands{};
+  int32_t number{};
+  Ast::BinaryOp binaryOp{};
+  std::string text{};
+};
+
+enum TerminatorKind { ReturnKind, JumpKind, BranchKind };
+
+struct Terminator {
+  TerminatorKind kind = ReturnKind;
+  // What is returned, passed to the target or branched on
+  Value value = NoValue;
+  // Jump target or where a branch goes when value is true
+  BlockId target = NoBlock;
+  // Where a branch goes when value is false
+  BlockId otherwise = NoBlock;
+  // Where both arms of a branch jump to when done, NoBlock if both return
+  BlockId join = NoBlock;
+};
+
+struct Block {
+  // Set on the block both arms of a branch join at
+  Value parameter = NoValue;
+  std::vector<Instr> instrs{};
+  Terminator terminator{};
+};
+
+struct Function {
+  // Name the function was bound to in the source, if any
+  std::string source{};
+  Ast::Location location{};
+  // The closure itself, for recursive calls, when bound by a let
+  Value self = NoValue;
+  std::vector<Value> parameters{};
+  // Variables of enclosing functions, in the order the ClosureOp that
+  // creates this function passes them
+  std::vector<Value> captures{};
+  // blocks[0] is the entry
+  std::vector<Block> blocks{};
+  // Type of each temporary, when known without running the program
+  std::vector<Type> types{};
+  // Names functions with the same code the same, see Module
+  std::string name{};
+};
+
+struct Module {
+  // Inner functions come before the functions that create them, and the
+  // program itself is the last one, with no parameters. Functions that only
+  // differ in the names of their variables are lowered once and get the
+  // same name
+  std::vector<Function> functions{};
+};
+
+// Without merge, every function of the program is lowered on its own, even
+// if it has the same code as another, as when each one is profiled
+Module lower(const Ast::Term &program, bool merge = true);
+
+// The type of a binary operation on values of types lhs and rhs, by the same
+// rules the runtime applies
+Type getBinaryType(Ast::BinaryOp op, Type lhs, Type rhs);
+
+// The instruction that computes each temporary of f, nullptr for parameters,
+// captures, self and block parameters
+std::vector<const Instr *> getDefinitions(const Function &f);
+
+// Whether each function of the module lets its own closure escape, using
+// self for anything but calling itself
+std::vector<bool> getEscapingSelves(const Module &module);
+
+// The tuples and closures of f that never outlive it, and so need not be on
+// the heap: tuples only taken apart by first and second, and closures with
+// captures only called, by functions that don't let themselves escape.
+// escapingSelves is what getEscapingSelves returns for the module of f.
+std::vector<bool> getLocalObjects(const Function &f,
+                                  const std::vector<bool> &escapingSelves);
+
+// Text form of the IR, for debugging
+std::string print(const Module &module);
+
+} // namespace Ir
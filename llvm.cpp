@@ -0,0 +1,932 @@
+#include <cstdio>
+#include <cstdlib>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "llvm.h"
+
+namespace {
+
+// Must match runtime.c
+constexpr int64_t tagInt = 1;
+constexpr int64_t tagBool = 2;
+constexpr int64_t boxedTrue = (1 << 3) | tagBool;
+constexpr int64_t boxedFalse = tagBool;
+constexpr uint64_t kindStr = 1;
+constexpr uint64_t kindClosure = 3;
+constexpr uint64_t flagStatic = 1;
+constexpr int closureCapturesOffset = 32;
+
+const char *declarations = R"(declare i64 @rt_print(i64)
+declare void @rt_write(ptr, i64)
+declare i64 @rt_add(i64, i64)
+declare i64 @rt_sub(i64, i64)
+declare i64 @rt_mul(i64, i64)
+declare i64 @rt_div(i64, i64)
+declare i64 @rt_rem(i64, i64)
+declare zeroext i1 @rt_eq(i64, i64)
+declare zeroext i1 @rt_lt(i64, i64)
+declare zeroext i1 @rt_lte(i64, i64)
+declare zeroext i1 @rt_gt(i64, i64)
+declare zeroext i1 @rt_gte(i64, i64)
+declare void @rt_bool_error() noreturn
+declare void @rt_div_error() noreturn
+declare i64 @rt_unbound(ptr)
+declare i64 @rt_tuple_new(i64, i64)
+declare i64 @rt_first(i64)
+declare i64 @rt_second(i64)
+declare i64 @rt_closure_new(ptr, i64, i64)
+declare ptr @rt_callee(i64, i64)
+declare i64 @rt_arity_error()
+)";
+
+std::string getBytes(std::string_view bytes) {
+  std::string literal = "c\"";
+  for (unsigned char c : bytes) {
+    if (c < ' ' || c >= 0x7f || c == '"' || c == '\\') {
+      char escaped[4];
+      snprintf(escaped, sizeof(escaped), "\\%02X", c);
+      literal.append(escaped);
+    } else {
+      literal.push_back(c);
+    }
+  }
+  return literal.append("\"");
+}
+
+std::string getHeader(uint64_t kind) {
+  return std::to_string(kind | (flagStatic << 32));
+}
+
+std::string getRuntimeOp(Ast::BinaryOp op) {
+  switch (op) {
+  case Ast::Add:
+    return "@rt_add";
+  case Ast::Sub:
+    return "@rt_sub";
+  case Ast::Mul:
+    return "@rt_mul";
+  case Ast::Div:
+    return "@rt_div";
+  case Ast::Rem:
+    return "@rt_rem";
+  case Ast::Eq:
+  case Ast::Neq:
+    return "@rt_eq";
+  case Ast::Lt:
+    return "@rt_lt";
+  case Ast::Gt:
+    return "@rt_gt";
+  case Ast::Lte:
+    return "@rt_lte";
+  case Ast::Gte:
+    return "@rt_gte";
+  case Ast::And:
+  case Ast::Or:
+    break;
+  }
+  __builtin_unreachable();
+}
+
+// Predicate of icmp for comparisons, nullptr for arithmetic
+const char *getPredicate(Ast::BinaryOp op) {
+  switch (op) {
+  case Ast::Eq:
+    return "eq";
+  case Ast::Neq:
+    return "ne";
+  case Ast::Lt:
+    return "slt";
+  case Ast::Gt:
+    return "sgt";
+  case Ast::Lte:
+    return "sle";
+  case Ast::Gte:
+    return "sge";
+  default:
+    return nullptr;
+  }
+}
+
+// Constants shared by the functions of a module
+struct Globals {
+  std::string text;
+  int count = 0;
+  std::unordered_map<std::string, std::string> strings;
+
+  // A static string object, as a value
+  std::string addString(const std::string &str) {
+    auto &value = strings[str];
+    if (!value.empty())
+      return value;
+
+    std::string const name = "@str." + std::to_string(count++);
+    std::string const type =
+        "{ i64, i64, [" + std::to_string(str.size()) + " x i8] }";
+    text.append(name)
+        .append(" = private unnamed_addr constant ")
+        .append(type)
+        .append(" { i64 ")
+        .append(getHeader(kindStr))
+        .append(", i64 ")
+        .append(std::to_string(str.size()))
+        .append(", [")
+        .append(std::to_string(str.size()))
+        .append(" x i8] ")
+        .append(getBytes(str))
+        .append(" }, align 8\n");
+    return value = "ptrtoint (ptr " + name + " to i64)";
+  }
+
+  // A NUL terminated string, as a pointer
+  std::string addCString(const std::string &str) {
+    std::string const name = "@cstr." + std::to_string(count++);
+    text.append(name)
+        .append(" = private unnamed_addr constant [")
+        .append(std::to_string(str.size() + 1))
+        .append(" x i8] ")
+        .append(getBytes(std::string(str).append(1, '\0')))
+        .append("\n");
+    return "ptr " + name;
+  }
+};
+
+// Not computed yet, while inferring types
+constexpr auto NoType = static_cast<Ir::Type>(-1);
+
+Ir::Type joinTypes(Ir::Type a, Ir::Type b) {
+  if (a == NoType || a == b)
+    return b;
+  return b == NoType ? a : Ir::UnknownType;
+}
+
+// The function a call goes to without looking it up, if any: the function
+// itself, or a closure created in it
+const Ir::Function *getDirectTarget(
+    const Ir::Module &module, const Ir::Function &f,
+    const std::vector<const Ir::Instr *> &definitions, Ir::Value callee) {
+  if (callee == f.self)
+    return &f;
+  if (auto const *definition = definitions[callee];
+      definition && definition->op == Ir::ClosureOp)
+    return &module.functions[definition->number];
+  return nullptr;
+}
+
+// Every function that returns an int whenever its parameters are ints also
+// gets a variant on i32s, called directly with arguments known to be ints
+using IntVariants = std::vector<bool>;
+
+bool hasIntVariant(const Ir::Module &module, const IntVariants &intVariants,
+                   const Ir::Function *target) {
+  return target && intVariants[target - module.functions.data()];
+}
+
+// Types of the values of f, as lowered but also knowing that direct calls
+// to int variants return ints, and with ints for parameters if intParameters
+std::vector<Ir::Type>
+inferTypes(const Ir::Module &module, const Ir::Function &f,
+           const std::vector<const Ir::Instr *> &definitions,
+           const IntVariants &intVariants, bool intParameters) {
+  std::vector<Ir::Type> types(f.types.size(), NoType);
+  for (auto const capture : f.captures)
+    types[capture] = f.types[capture];
+  if (f.self != Ir::NoValue)
+    types[f.self] = Ir::UnknownType;
+  for (auto const parameter : f.parameters)
+    types[parameter] = intParameters ? Ir::IntType : Ir::UnknownType;
+
+  auto const getType = [&](const Ir::Instr &instr) {
+    auto const &operands = instr.operands;
+    switch (instr.op) {
+    case Ir::IntOp:
+      return Ir::IntType;
+    case Ir::BoolOp:
+      return Ir::BoolType;
+    case Ir::StrOp:
+      return Ir::StrType;
+    case Ir::BinaryOp:
+      if (types[operands[0]] == NoType || types[operands[1]] == NoType)
+        return NoType;
+      return Ir::getBinaryType(instr.binaryOp, types[operands[0]],
+                               types[operands[1]]);
+    case Ir::PrintOp:
+      return types[operands[0]];
+    case Ir::CallOp: {
+      auto const *target = getDirectTarget(module, f, definitions, operands[0]);
+      if (!hasIntVariant(module, intVariants, target) ||
+          target->parameters.size() != operands.size() - 1)
+        return Ir::UnknownType;
+      for (std::size_t i = 1; i < operands.size(); i++)
+        if (types[operands[i]] != Ir::IntType)
+          return types[operands[i]] == NoType ? NoType : Ir::UnknownType;
+      return Ir::IntType;
+    }
+    default:
+      return Ir::UnknownType;
+    }
+  };
+
+  // Join blocks may come before the arms that jump to them, so this goes
+  // over the function until nothing changes. Whatever is still unknown
+  // then, like the value of a call that never returns, is just unknown
+  for (bool pending = true; pending;) {
+    for (bool changed = true; changed;) {
+      changed = false;
+      auto const set = [&](Ir::Value value, Ir::Type type) {
+        if (type != NoType && types[value] != type) {
+          types[value] = type;
+          changed = true;
+        }
+      };
+      for (auto const &block : f.blocks) {
+        for (auto const &instr : block.instrs)
+          set(instr.result, getType(instr));
+        if (block.terminator.kind == Ir::JumpKind) {
+          Ir::Value const parameter =
+              f.blocks[block.terminator.target].parameter;
+          set(parameter,
+              joinTypes(types[parameter], types[block.terminator.value]));
+        }
+      }
+    }
+
+    pending = false;
+    for (auto &type : types) {
+      if (type == NoType) {
+        type = Ir::UnknownType;
+        pending = true;
+      }
+    }
+  }
+  return types;
+}
+
+class FunctionEmitter {
+public:
+  FunctionEmitter(const Ir::Module &module, const Ir::Function &f,
+                  const std::vector<bool> &escapingSelves,
+                  const IntVariants &intVariants, bool intVariant,
+                  Globals &globals)
+      : module(module), f(f), definitions(Ir::getDefinitions(f)),
+        intVariants(intVariants), intVariant(intVariant),
+        types(inferTypes(module, f, definitions, intVariants, intVariant)),
+        aliases(definitions.size(), Ir::NoValue),
+        local(Ir::getLocalObjects(f, escapingSelves)),
+        replacements(definitions.size()), globals(globals),
+        blocks(f.blocks.size()), incoming(f.blocks.size()) {}
+
+  // Whether every value f returns is an int
+  bool returnsInts() const {
+    for (auto const &block : f.blocks)
+      if (block.terminator.kind == Ir::ReturnKind &&
+          types[block.terminator.value] != Ir::IntType)
+        return false;
+    return true;
+  }
+
+  std::string emit() {
+    std::string response = "define ";
+    if (isMain()) {
+      response.append("i64 @rinha_main() {\n");
+    } else {
+      response.append("internal ")
+          .append(getReturnRepr())
+          .append(" @")
+          .append(getFunctionName(f, intVariant))
+          .append("(i64 %env");
+      for (auto const parameter : f.parameters)
+        response.append(", ")
+            .append(getRepr(parameter))
+            .append(" ")
+            .append(getName(parameter));
+      response.append(") {\n");
+    }
+
+    for (Ir::BlockId b = 0; b < f.blocks.size(); b++) {
+      out = &blocks[b];
+      label = "b" + std::to_string(b);
+      if (b == 0)
+        loadCaptures();
+
+      auto const &block = f.blocks[b];
+      for (auto const &instr : block.instrs)
+        emitInstr(instr, block.terminator.kind == Ir::ReturnKind &&
+                             &instr == &block.instrs.back() &&
+                             instr.result == block.terminator.value);
+      emitTerminator(f.blocks[b].terminator);
+    }
+
+    for (Ir::BlockId b = 0; b < f.blocks.size(); b++) {
+      response.append("b").append(std::to_string(b)).append(":\n");
+
+      Ir::Value const parameter = f.blocks[b].parameter;
+      if (parameter != Ir::NoValue) {
+        response.append("  ")
+            .append(getName(parameter))
+            .append(" = phi ")
+            .append(getRepr(parameter));
+        for (std::size_t i = 0; i < incoming[b].size(); i++)
+          response.append(i ? ", [ " : " [ ")
+              .append(incoming[b][i].first)
+              .append(", %")
+              .append(incoming[b][i].second)
+              .append(" ]");
+        response.append("\n");
+      }
+      if (b == 0)
+        response.append(allocas);
+      response.append(blocks[b]);
+    }
+
+    return response.append("}\n\n");
+  }
+
+private:
+  const Ir::Module &module;
+  const Ir::Function &f;
+  std::vector<const Ir::Instr *> definitions;
+  const IntVariants &intVariants;
+  // Whether this is the variant of f on i32s
+  bool intVariant;
+  std::vector<Ir::Type> types;
+  // What each print resolves to once looked through, see resolve
+  std::vector<Ir::Value> aliases;
+  // Tuples and closures that are kept off the heap, and the operands that
+  // stand for the fields taken out of such tuples
+  std::vector<bool> local;
+  std::vector<std::string> replacements;
+  Globals &globals;
+
+  // Instructions of each block, without the phi of its parameter, and the
+  // stack slots of local closures, at the start of the entry block
+  std::vector<std::string> blocks;
+  std::string allocas;
+  // Value and label of the predecessors of each block that has a parameter
+  std::vector<std::vector<std::pair<std::string, std::string>>> incoming;
+
+  // Block being written, and its label: checks split IR blocks in several
+  std::string *out = nullptr;
+  std::string label;
+  int temporaries = 0;
+
+  void line(const std::string &text) { out->append("  ").append(text) += '\n'; }
+
+  std::string newTemporary() { return "%." + std::to_string(temporaries++); }
+
+  std::string newLabel() { return "l." + std::to_string(temporaries++); }
+
+  void startBlock(const std::string &name) {
+    out->append(name).append(":\n");
+    label = name;
+  }
+
+  static std::string getName(Ir::Value value) {
+    return "%t" + std::to_string(value);
+  }
+
+  static std::string getFunctionName(const Ir::Function &target,
+                                     bool intVariant) {
+    return intVariant ? target.name + ".int" : target.name;
+  }
+
+  bool isMain() const { return &f == &module.functions.back(); }
+
+  std::string getReturnRepr() const { return intVariant ? "i32" : "i64"; }
+
+  // Ints and bools whose type is known are kept unboxed
+  std::string getRepr(Ir::Value value) const {
+    switch (types[value]) {
+    case Ir::IntType:
+      return "i32";
+    case Ir::BoolType:
+      return "i1";
+    default:
+      return "i64";
+    }
+  }
+
+  // The value as an operand of its own representation
+  bool isPrint(Ir::Value value) const {
+    return definitions[value] && definitions[value]->op == Ir::PrintOp;
+  }
+
+  // Print returns its argument, so a printed value is its argument. Chains
+  // of prints are followed once and remembered
+  Ir::Value resolve(Ir::Value value) {
+    auto const next = [&](Ir::Value v) {
+      return aliases[v] != Ir::NoValue ? aliases[v]
+                                       : definitions[v]->operands[0];
+    };
+
+    Ir::Value root = value;
+    while (isPrint(root))
+      root = next(root);
+    for (Ir::Value v = value; v != root;) {
+      Ir::Value const following = next(v);
+      aliases[v] = root;
+      v = following;
+    }
+    return root;
+  }
+
+  std::string get(Ir::Value value) {
+    value = resolve(value);
+    if (value == f.self)
+      return "%env";
+    if (!replacements[value].empty())
+      return replacements[value];
+
+    auto const *instr = definitions[value];
+    if (!instr)
+      return getName(value);
+
+    switch (instr->op) {
+    case Ir::IntOp:
+      return std::to_string(instr->number);
+    case Ir::BoolOp:
+      return instr->number ? "true" : "false";
+    case Ir::StrOp:
+      return globals.addString(instr->text);
+    case Ir::ClosureOp:
+      if (instr->operands.empty())
+        return "ptrtoint (ptr @" + module.functions[instr->number].name +
+               ".closure to i64)";
+      return getName(value);
+    default:
+      return getName(value);
+    }
+  }
+
+  std::string getBoxed(Ir::Value value) {
+    value = resolve(value);
+    auto const repr = getRepr(value);
+    if (repr == "i64")
+      return get(value);
+
+    auto const *instr = definitions[value];
+    if (instr && instr->op == Ir::IntOp)
+      return std::to_string(static_cast<int64_t>(
+          (static_cast<uint64_t>(static_cast<int64_t>(instr->number)) << 3) |
+          tagInt));
+    if (instr && instr->op == Ir::BoolOp)
+      return std::to_string(instr->number ? boxedTrue : boxedFalse);
+
+    auto const wide = newTemporary();
+    auto const shifted = newTemporary();
+    auto const boxed = newTemporary();
+    line(wide + " = " + (repr == "i32" ? "sext i32 " : "zext i1 ") +
+         get(value) + " to i64");
+    line(shifted + " = shl i64 " + wide + ", 3");
+    line(boxed + " = or i64 " + shifted + ", " +
+         std::to_string(repr == "i32" ? tagInt : tagBool));
+    return boxed;
+  }
+
+  // Writes the unboxed form of a boxed operand to name
+  void unbox(const std::string &boxed, Ir::Type type,
+             const std::string &name) {
+    auto const shifted = newTemporary();
+    line(shifted + " = ashr i64 " + boxed + ", 3");
+    line(name + " = trunc i64 " + shifted +
+         (type == Ir::IntType ? " to i32" : " to i1"));
+  }
+
+  void loadCaptures() {
+    if (f.captures.empty())
+      return;
+
+    auto const env = newTemporary();
+    line(env + " = inttoptr i64 %env to ptr");
+    for (std::size_t i = 0; i < f.captures.size(); i++) {
+      Ir::Value const capture = f.captures[i];
+      auto const field = newTemporary();
+      line(field + " = getelementptr i8, ptr " + env + ", i64 " +
+           std::to_string(closureCapturesOffset + 8 * i));
+
+      if (getRepr(capture) == "i64") {
+        line(getName(capture) + " = load i64, ptr " + field);
+      } else {
+        auto const boxed = newTemporary();
+        line(boxed + " = load i64, ptr " + field);
+        unbox(boxed, types[capture], getName(capture));
+      }
+    }
+  }
+
+  // Calls a runtime function that doesn't return
+  void fail(const std::string &function) {
+    line("call void " + function + "()");
+    line("unreachable");
+  }
+
+  // Writes a op b on i32s to result, checking divisions
+  void emitIntOp(Ast::BinaryOp op, const std::string &a, const std::string &b,
+                 const std::string &result) {
+    if (auto const *predicate = getPredicate(op)) {
+      line(result + " = icmp " + predicate + " i32 " + a + ", " + b);
+      return;
+    }
+
+    switch (op) {
+    case Ast::Add:
+      line(result + " = add i32 " + a + ", " + b);
+      return;
+    case Ast::Sub:
+      line(result + " = sub i32 " + a + ", " + b);
+      return;
+    case Ast::Mul:
+      line(result + " = mul i32 " + a + ", " + b);
+      return;
+    default:
+      break;
+    }
+
+    // Dividing by zero is an error, and by -1 must wrap instead of trapping
+    char *end = nullptr;
+    long const divisor = strtol(b.c_str(), &end, 10);
+    bool const isConstant = !b.empty() && *end == '\0';
+    char const *instruction = op == Ast::Div ? "sdiv" : "srem";
+    if (isConstant && divisor != 0 && divisor != -1) {
+      line(result + " = " + instruction + " i32 " + a + ", " + b);
+      return;
+    }
+
+    auto const isZero = newTemporary();
+    auto const error = newLabel();
+    auto const ok = newLabel();
+    line(isZero + " = icmp eq i32 " + b + ", 0");
+    line("br i1 " + isZero + ", label %" + error + ", label %" + ok);
+    startBlock(error);
+    fail("@rt_div_error");
+    startBlock(ok);
+
+    auto const isMinusOne = newTemporary();
+    auto const divisorOrOne = newTemporary();
+    auto const quotient = newTemporary();
+    line(isMinusOne + " = icmp eq i32 " + b + ", -1");
+    line(divisorOrOne + " = select i1 " + isMinusOne + ", i32 1, i32 " + b);
+    line(quotient + " = " + instruction + " i32 " + a + ", " + divisorOrOne);
+    if (op == Ast::Div) {
+      auto const negated = newTemporary();
+      line(negated + " = sub i32 0, " + a);
+      line(result + " = select i1 " + isMinusOne + ", i32 " + negated +
+           ", i32 " + quotient);
+    } else {
+      line(result + " = select i1 " + isMinusOne + ", i32 0, i32 " +
+           quotient);
+    }
+  }
+
+  // Calls the runtime for a op b on boxed values
+  void emitRuntimeOp(Ast::BinaryOp op, const std::string &a,
+                     const std::string &b, const std::string &result) {
+    bool const compares = getPredicate(op) != nullptr;
+    if (op == Ast::Neq) {
+      auto const equal = newTemporary();
+      line(equal + " = call i1 @rt_eq(i64 " + a + ", i64 " + b + ")");
+      line(result + " = xor i1 " + equal + ", true");
+      return;
+    }
+    line(result + " = call " + (compares ? "i1 " : "i64 ") +
+         getRuntimeOp(op) + "(i64 " + a + ", i64 " + b + ")");
+  }
+
+  void emitBinary(const Ir::Instr &instr) {
+    Ir::Value const lhs = instr.operands[0], rhs = instr.operands[1];
+    Ir::Type const lhsType = types[lhs], rhsType = types[rhs];
+    auto const result = getName(instr.result);
+    bool const compares = getPredicate(instr.binaryOp) != nullptr;
+
+    if (lhsType == Ir::IntType && rhsType == Ir::IntType) {
+      emitIntOp(instr.binaryOp, get(lhs), get(rhs), result);
+      return;
+    }
+
+    if (lhsType == Ir::BoolType && rhsType == Ir::BoolType &&
+        (instr.binaryOp == Ast::Eq || instr.binaryOp == Ast::Neq)) {
+      line(result + " = icmp " + getPredicate(instr.binaryOp) + " i1 " +
+           get(lhs) + ", " + get(rhs));
+      return;
+    }
+
+    auto const a = getBoxed(lhs);
+    auto const b = getBoxed(rhs);
+
+    // Anything but ints goes to the runtime
+    bool const mayBeInts = (lhsType == Ir::IntType || lhsType == Ir::UnknownType) &&
+                           (rhsType == Ir::IntType || rhsType == Ir::UnknownType);
+    if (!mayBeInts) {
+      emitRuntimeOp(instr.binaryOp, a, b, result);
+      return;
+    }
+
+    // Ints are checked for and handled inline, everything else by the
+    // runtime. The int tag is the only one with the low bit set, so both
+    // values are ints when their tags anded are the int tag
+    auto const both = newTemporary();
+    auto const tags = newTemporary();
+    auto const isInts = newTemporary();
+    auto const fast = newLabel();
+    auto const slow = newLabel();
+    auto const join = newLabel();
+    line(both + " = and i64 " + a + ", " + b);
+    line(tags + " = and i64 " + both + ", 7");
+    line(isInts + " = icmp eq i64 " + tags + ", " + std::to_string(tagInt));
+    line("br i1 " + isInts + ", label %" + fast + ", label %" + slow);
+
+    startBlock(fast);
+    auto const x = newTemporary();
+    auto const y = newTemporary();
+    unbox(a, Ir::IntType, x);
+    unbox(b, Ir::IntType, y);
+    auto const value = newTemporary();
+    emitIntOp(instr.binaryOp, x, y, value);
+    std::string fastValue = value;
+    if (!compares) {
+      auto const wide = newTemporary();
+      auto const shifted = newTemporary();
+      fastValue = newTemporary();
+      line(wide + " = sext i32 " + value + " to i64");
+      line(shifted + " = shl i64 " + wide + ", 3");
+      line(fastValue + " = or i64 " + shifted + ", " + std::to_string(tagInt));
+    }
+    auto const fastEnd = label;
+    line("br label %" + join);
+
+    startBlock(slow);
+    auto const slowValue = newTemporary();
+    emitRuntimeOp(instr.binaryOp, a, b, slowValue);
+    line("br label %" + join);
+
+    startBlock(join);
+    line(result + " = phi " + (compares ? "i1" : "i64") + " [ " + fastValue +
+         ", %" + fastEnd + " ], [ " + slowValue + ", %" + slow + " ]");
+  }
+
+  // A call whose value is returned right away is a tail call. When both
+  // functions have the same signature it must reuse this frame, so loops
+  // written as recursion don't grow the stack even unoptimized. Calls to
+  // closures in this frame can't be, as they read their captures from it.
+  // Parameters of a function are all i64, or all i32 in its int variant
+  std::string getCallKind(Ir::Value callee, std::size_t numArgs, bool tail,
+                          const std::string &repr) const {
+    if (!tail || local[callee])
+      return "call ";
+    if (!isMain() && repr == getReturnRepr() &&
+        numArgs == f.parameters.size())
+      return "musttail call ";
+    return "tail call ";
+  }
+
+  void emitCall(const Ir::Instr &instr, bool tail) {
+    Ir::Value const callee = resolve(instr.operands[0]);
+    std::size_t const numArgs = instr.operands.size() - 1;
+    auto const result = getName(instr.result);
+    auto const *target = getDirectTarget(module, f, definitions, callee);
+
+    if (target && target->parameters.size() != numArgs) {
+      line(result + " = call i64 @rt_arity_error()");
+      return;
+    }
+
+    // Direct calls with int arguments go to the int variant, if there is one
+    if (types[instr.result] == Ir::IntType) {
+      std::string arguments;
+      for (std::size_t i = 1; i < instr.operands.size(); i++)
+        arguments.append(", i32 ").append(get(instr.operands[i]));
+      line(result + " = " + getCallKind(callee, numArgs, tail, "i32") + "i32 @" +
+           getFunctionName(*target, true) + "(i64 " + get(callee) +
+           arguments + ")");
+      return;
+    }
+
+    std::string arguments;
+    for (std::size_t i = 1; i < instr.operands.size(); i++)
+      arguments.append(", i64 ").append(getBoxed(instr.operands[i]));
+    auto const kind = getCallKind(callee, numArgs, tail, "i64");
+
+    if (target) {
+      line(result + " = " + kind + "i64 @" + target->name + "(i64 " +
+           get(callee) + arguments + ")");
+      return;
+    }
+
+    auto const closure = getBoxed(callee);
+    auto const fn = newTemporary();
+    line(fn + " = call ptr @rt_callee(i64 " + closure + ", i64 " +
+         std::to_string(numArgs) + ")");
+    line(result + " = " + kind + "i64 " + fn + "(i64 " + closure + arguments +
+         ")");
+  }
+
+  void emitClosure(const Ir::Instr &instr) {
+    if (instr.operands.empty())
+      return;
+
+    auto const &target = module.functions[instr.number];
+    auto const result = getName(instr.result);
+    auto const closure = newTemporary();
+
+    // A closure that is only called directly lives in this frame, and only
+    // its captures are read
+    if (local[instr.result]) {
+      allocas.append("  ")
+          .append(closure)
+          .append(" = alloca [")
+          .append(std::to_string(closureCapturesOffset / 8 +
+                                 instr.operands.size()))
+          .append(" x i64], align 8\n");
+      line(result + " = ptrtoint ptr " + closure + " to i64");
+    } else {
+      line(result + " = call i64 @rt_closure_new(ptr @" + target.name +
+           ", i64 " + std::to_string(target.parameters.size()) + ", i64 " +
+           std::to_string(instr.operands.size()) + ")");
+      line(closure + " = inttoptr i64 " + result + " to ptr");
+    }
+
+    for (std::size_t i = 0; i < instr.operands.size(); i++) {
+      auto const value = getBoxed(instr.operands[i]);
+      auto const field = newTemporary();
+      line(field + " = getelementptr i8, ptr " + closure + ", i64 " +
+           std::to_string(closureCapturesOffset + 8 * i));
+      line("store i64 " + value + ", ptr " + field);
+    }
+  }
+
+  // tail is whether instr is what its block returns, as its last instruction
+  void emitInstr(const Ir::Instr &instr, bool tail) {
+    auto const result = getName(instr.result);
+    switch (instr.op) {
+    case Ir::IntOp:
+    case Ir::BoolOp:
+    case Ir::StrOp:
+      return;
+
+    case Ir::BinaryOp:
+      emitBinary(instr);
+      return;
+
+    case Ir::CallOp:
+      emitCall(instr, tail);
+      return;
+
+    case Ir::ClosureOp:
+      emitClosure(instr);
+      return;
+
+    // Local tuples are never built: first and second just use their fields
+    case Ir::TupleOp: {
+      if (local[instr.result])
+        return;
+      auto const first = getBoxed(instr.operands[0]);
+      auto const second = getBoxed(instr.operands[1]);
+      line(result + " = call i64 @rt_tuple_new(i64 " + first + ", i64 " +
+           second + ")");
+      return;
+    }
+
+    case Ir::FirstOp:
+    case Ir::SecondOp: {
+      Ir::Value const tuple = instr.operands[0];
+      std::size_t const field = instr.op == Ir::FirstOp ? 0 : 1;
+      if (local[tuple]) {
+        replacements[instr.result] =
+            getBoxed(definitions[tuple]->operands[field]);
+        return;
+      }
+      line(result + " = call i64 " +
+           (field ? "@rt_second" : "@rt_first") + "(i64 " +
+           getBoxed(tuple) + ")");
+      return;
+    }
+
+    case Ir::PrintOp:
+      line("call i64 @rt_print(i64 " + getBoxed(instr.operands[0]) + ")");
+      return;
+
+    case Ir::UnboundOp:
+      line(result + " = call i64 @rt_unbound(" +
+           globals.addCString(instr.text) + ")");
+      return;
+    }
+  }
+
+  void emitTerminator(const Ir::Terminator &terminator) {
+    switch (terminator.kind) {
+    case Ir::ReturnKind:
+      line("ret " + getReturnRepr() + " " +
+           (intVariant ? get(terminator.value) : getBoxed(terminator.value)));
+      return;
+
+    case Ir::JumpKind: {
+      Ir::Value const parameter = f.blocks[terminator.target].parameter;
+      auto const value = getRepr(parameter) == "i64"
+                             ? getBoxed(terminator.value)
+                             : get(terminator.value);
+      incoming[terminator.target].emplace_back(value, label);
+      line("br label %b" + std::to_string(terminator.target));
+      return;
+    }
+
+    case Ir::BranchKind:
+      break;
+    }
+
+    auto const then = "label %b" + std::to_string(terminator.target);
+    auto const otherwise = "label %b" + std::to_string(terminator.otherwise);
+    if (types[terminator.value] == Ir::BoolType) {
+      line("br i1 " + get(terminator.value) + ", " + then + ", " + otherwise);
+      return;
+    }
+
+    // Anything but a bool is an error
+    auto const value = getBoxed(terminator.value);
+    auto const isTrue = newTemporary();
+    auto const isFalse = newTemporary();
+    auto const isBool = newTemporary();
+    auto const error = newLabel();
+    auto const ok = newLabel();
+    line(isTrue + " = icmp eq i64 " + value + ", " +
+         std::to_string(boxedTrue));
+    line(isFalse + " = icmp eq i64 " + value + ", " +
+         std::to_string(boxedFalse));
+    line(isBool + " = or i1 " + isTrue + ", " + isFalse);
+    line("br i1 " + isBool + ", label %" + ok + ", label %" + error);
+    startBlock(error);
+    fail("@rt_bool_error");
+    startBlock(ok);
+    line("br i1 " + isTrue + ", " + then + ", " + otherwise);
+  }
+};
+
+} // namespace
+
+namespace Llvm {
+
+std::string emit(const Ir::Module &module) {
+  Globals globals;
+  std::string functions;
+  auto const escapingSelves = Ir::getEscapingSelves(module);
+
+  // Inner functions come first, so the int variants a function calls are
+  // known by the time it is. Its own is assumed, and kept if it holds
+  IntVariants intVariants(module.functions.size());
+  for (std::size_t i = 0; i + 1 < module.functions.size(); i++) {
+    auto const &f = module.functions[i];
+    if (f.parameters.empty())
+      continue;
+    intVariants[i] = true;
+    intVariants[i] =
+        FunctionEmitter(module, f, escapingSelves, intVariants, true, globals)
+            .returnsInts();
+  }
+
+  for (std::size_t i = 0; i < module.functions.size(); i++) {
+    auto const &f = module.functions[i];
+    functions.append(
+        FunctionEmitter(module, f, escapingSelves, intVariants, false, globals)
+            .emit());
+    if (intVariants[i])
+      functions.append(
+          FunctionEmitter(module, f, escapingSelves, intVariants, true, globals)
+              .emit());
+
+    // Functions that capture nothing need no allocation to become closures
+    if (i + 1 < module.functions.size() && f.captures.empty())
+      globals.text.append("@")
+          .append(f.name)
+          .append(".closure = private constant { i64, ptr, i64, i64 } { i64 ")
+          .append(getHeader(kindClosure))
+          .append(", ptr @")
+          .append(f.name)
+          .append(", i64 ")
+          .append(std::to_string(f.parameters.size()))
+          .append(", i64 0 }, align 8\n");
+  }
+
+  return std::string(declarations)
+      .append("\n")
+      .append(globals.text)
+      .append("\n")
+      .append(functions);
+}
+
+std::string emitOutput(const std::string &output) {
+  return std::string("declare void @rt_write(ptr, i64)\n\n")
+      .append("@output = private unnamed_addr constant [")
+      .append(std::to_string(output.size()))
+      .append(" x i8] ")
+      .append(getBytes(output))
+      .append("\n\n")
+      .append("define i64 @rinha_main() {\n")
+      .append("  call void @rt_write(ptr @output, i64 ")
+      .append(std::to_string(output.size()))
+      .append(")\n")
+      .append("  ret i64 0\n")
+      .append("}\n");
+}
+
+} // namespace Llvm
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <string>
+
+#include "ir.h"
+
+// Textual LLVM IR for the program, to be built with runtime.c by clang or
+// opt/llc and a C compiler. It uses opaque pointers, so LLVM 14 needs
+// -opaque-pointers.
+namespace Llvm {
+
+std::string emit(const Ir::Module &module);
+
+// A module that only writes output, for programs the compiler already ran
+std::string emitOutput(const std::string &output);
+
+} // namespace Llvm
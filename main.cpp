@@ -1,9 +1,31 @@
-
 #include <cassert>
+#include <cstdlib>
+#include <cstring>
 
 #include "generate.h"
 
 int main(int argc, char **argv) {
-  assert(argc == 3);
-  return generateFromJson(argv[1], argv[2]);
+  assert(argc >= 3);
+
+  GenerateOptions options;
+  for (int i = 3; i < argc; i++) {
+    if (!strcmp(argv[i], "--stats"))
+      options.stats = true;
+    else if (!strcmp(argv[i], "--profile"))
+      options.profile = true;
+    else if (!strcmp(argv[i], "--emit-ir"))
+      options.emitIr = true;
+    else if (!strcmp(argv[i], "--eval"))
+      options.evaluate = true;
+    else if (!strncmp(argv[i], "--fuel=", 7))
+      options.fuel = strtoull(argv[i] + 7, nullptr, 10);
+    else if (!strncmp(argv[i], "--fuel-bytes=", 13))
+      options.fuelBytes = strtoull(argv[i] + 13, nullptr, 10);
+    else if (!strncmp(argv[i], "--fuel-ms=", 10))
+      options.fuelMs = strtoull(argv[i] + 10, nullptr, 10);
+    else
+      return 1;
+  }
+
+  return generateFromJson(argv[1], argv[2], options);
 }
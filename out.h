@@ -1,27 +1,29 @@
+#include <csignal>
 #include <cstdio>
 #include <cstdlib>
 #include <functional>
 #include <string>
+#include <unistd.h>
 
-int print(int arg, bool append_newline = true) {
+static inline int print(int arg, bool append_newline = true) {
   printf("%d", arg);
   printf(append_newline ? "\n" : "");
   return arg;
 }
 
-const char *print(const char *arg, bool append_newline = true) {
+static inline const char *print(const char *arg, bool append_newline = true) {
   printf("%s", arg);
   printf(append_newline ? "\n" : "");
   return arg;
 }
 
-std::string print(std::string arg, bool append_newline = true) {
+static inline std::string print(std::string arg, bool append_newline = true) {
   printf("%s", arg.c_str());
   printf(append_newline ? "\n" : "");
   return arg;
 }
 
-bool print(bool arg, bool append_newline = true) {
+static inline bool print(bool arg, bool append_newline = true) {
   printf("%s", arg ? "true" : "false");
   printf(append_newline ? "\n" : "");
   return arg;
@@ -39,6 +41,10 @@ template <typename T0, typename T1> struct __tuple {
   T1 second;
 };
 
+// Lets __tuple{first, second} deduce its types, so the generated code spells
+// each component once instead of again inside a decltype
+template <typename T0, typename T1> __tuple(T0, T1) -> __tuple<T0, T1>;
+
 template <typename T0, typename T1>
 struct __tuple<T0, T1> print(struct __tuple<T0, T1> arg) {
   printf("(");
@@ -151,6 +157,12 @@ static inline auto __gte(T a, T b) {
   return a >= b;
 }
 
+// Operands of && and || whose type is only known after instantiation
+template <typename T, typename = std::enable_if_t<std::is_same_v<T, bool>>>
+static inline bool __bool(T a) {
+  return a;
+}
+
 template <typename T, typename = std::enable_if_t<std::is_same_v<T, bool>>>
 static inline auto __and(T a, T b) {
   return a && b;
@@ -160,3 +172,150 @@ template <typename T, typename = std::enable_if_t<std::is_same_v<T, bool>>>
 static inline auto __or(T a, T b) {
   return a || b;
 }
+
+// Training runs of a PGO build (see run.sh) stop after $RINHA_TRAIN_SECONDS,
+// writing the profile gathered so far, which is only written at exit
+extern "C" int __llvm_profile_write_file(void) __attribute__((weak));
+
+static const bool __training = [] {
+  if (const char *seconds = getenv("RINHA_TRAIN_SECONDS")) {
+    signal(SIGALRM, [](int) {
+      if (__llvm_profile_write_file)
+        __llvm_profile_write_file();
+      _exit(0);
+    });
+    alarm(atoi(seconds));
+  }
+  return true;
+}();
+
+#ifdef RINHA_PROFILE
+#include <algorithm>
+#include <cinttypes>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline uint64_t __prof_now() { return __rdtsc(); }
+#else
+#include <chrono>
+static inline uint64_t __prof_now() {
+  return std::chrono::steady_clock::now().time_since_epoch().count();
+}
+#endif
+
+// Counters of a single Rinha function. Entries are trivially destructible and
+// chained in a list, so they are still readable when the report runs at exit
+struct __prof_entry {
+  const char *name;
+  const char *file;
+  int start, end;
+  uint64_t calls = 0, inclusive = 0, children = 0, entered = 0;
+  uint32_t depth = 0, max_depth = 0;
+  __prof_entry *next;
+  // The function whose outermost activation encloses this one's
+  __prof_entry *caller = nullptr;
+
+  static inline __prof_entry *head = nullptr;
+  // The function of the innermost outermost activation running
+  static inline __prof_entry *running = nullptr;
+
+  __prof_entry(const char *name, const char *file, int start, int end)
+      : name(name), file(file), start(start), end(end), next(head) {
+    head = this;
+  }
+};
+
+// Lives for the duration of one call. Every call is counted, but only the
+// outermost activation of a function reads the clock, so recursive calls
+// cost a few increments and inclusive time is not counted twice.
+//
+// Outermost activations nest, so each one adds its time to the children of
+// the one enclosing it, and exclusive time is inclusive minus children. A
+// recursive call made from inside another function counts as that function's
+// exclusive time, since it doesn't read the clock
+struct __prof_scope {
+  __prof_entry &entry;
+
+  explicit __prof_scope(__prof_entry &entry) : entry(entry) {
+    entry.calls++;
+    entry.max_depth = std::max(entry.max_depth, ++entry.depth);
+    if (entry.depth == 1) {
+      entry.caller = __prof_entry::running;
+      __prof_entry::running = &entry;
+      entry.entered = __prof_now();
+    }
+  }
+
+  ~__prof_scope() {
+    if (--entry.depth == 0) {
+      auto const elapsed = __prof_now() - entry.entered;
+      entry.inclusive += elapsed;
+      __prof_entry::running = entry.caller;
+      if (entry.caller)
+        entry.caller->children += elapsed;
+    }
+  }
+};
+
+// Writes str as the contents of a JSON string
+static void __prof_write_json(FILE *out, const char *str) {
+  for (; *str; str++) {
+    unsigned char const c = *str;
+    if (c < 0x20)
+      fprintf(out, "\\u%04x", c);
+    else if (c == '"' || c == '\\')
+      fprintf(out, "\\%c", c);
+    else
+      fputc(c, out);
+  }
+}
+
+// Prints the table to stderr when the program exits, sorted by inclusive
+// time, or writes it as JSON to $RINHA_PROFILE_JSON when that is set
+static struct __prof_report {
+  ~__prof_report() {
+    std::vector<const __prof_entry *> entries;
+    for (auto *e = __prof_entry::head; e; e = e->next)
+      entries.push_back(e);
+    std::sort(entries.begin(), entries.end(), [](auto *a, auto *b) {
+      return a->inclusive > b->inclusive;
+    });
+
+    if (const char *path = getenv("RINHA_PROFILE_JSON")) {
+      FILE *out = fopen(path, "w");
+      if (!out)
+        return;
+      fprintf(out, "[");
+      for (std::size_t i = 0; i < entries.size(); i++) {
+        auto *e = entries[i];
+        fprintf(out, "%s\n  {\"name\": \"", i ? "," : "");
+        __prof_write_json(out, e->name);
+        fprintf(out, "\", \"location\": {\"filename\": \"");
+        __prof_write_json(out, e->file);
+        fprintf(out,
+                "\", \"start\": %d, \"end\": %d}, \"calls\": %" PRIu64
+                ", \"inclusive\": %" PRIu64 ", \"exclusive\": %" PRIu64
+                ", \"max_depth\": %u}",
+                e->start, e->end, e->calls, e->inclusive,
+                e->inclusive - e->children, e->max_depth);
+      }
+      fprintf(out, "\n]\n");
+      fclose(out);
+      return;
+    }
+
+    fprintf(stderr, "%-24s %-24s %12s %16s %16s %10s\n", "function",
+            "location", "calls", "inclusive", "exclusive", "max depth");
+    for (auto *e : entries) {
+      char location[64];
+      snprintf(location, sizeof(location), "%s:%d-%d", e->file, e->start,
+               e->end);
+      fprintf(stderr,
+              "%-24s %-24s %12" PRIu64 " %16" PRIu64 " %16" PRIu64 " %10u\n",
+              e->name, location, e->calls, e->inclusive,
+              e->inclusive - e->children, e->max_depth);
+    }
+  }
+} __prof_report_at_exit;
+#endif
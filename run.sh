@@ -2,21 +2,236 @@
 
 # set -x
 
+# Compiled runners are kept here, keyed by the hash of the whole generated
+# program. Once the cache grows past CACHE_MAX_KB, the runners used least
+# recently are removed
+CACHE_DIR=${RINHA_CACHE_DIR:-.rinha-cache}
+CACHE_MAX_KB=${RINHA_CACHE_MAX_KB:-262144}
+
+# Runners are first built quickly. One that runs for longer than this is
+# rebuilt optimized in the background, with a profile of a training run this
+# long, and that build is the one used from then on
+PGO_THRESHOLD_MS=${RINHA_PGO_THRESHOLD_MS:-500}
+PGO_TRAIN_SECONDS=${RINHA_PGO_TRAIN_SECONDS:-2}
+
+# Whether CACHE_DIR outlives this run. When it doesn't, as in a container
+# without a volume for it, runners are built optimized right away, since
+# there is no next run to rebuild them for
+CACHE_PERSISTENT=${RINHA_CACHE_PERSISTENT:-1}
+
 rm -f generated_main.cpp > /dev/null
+rm -f generated_main.ll > /dev/null
 rm -f cpp-rinher-runner > /dev/null
 rm -f generated_main.jl > /dev/null
+rm -f generated_output.txt > /dev/null
 
-./cpp-rinher-compiler $1 1
-if [ $? -eq 0 ]; then
+# Builds the LLVM IR in $2 with runtime.c into $1, with the flags that
+# follow. LLVM before 15 only reads opaque pointers when asked to, and
+# without clang there is no profile runtime, so only an optimization level
+# can be passed
+build_llvm() {
+    if command -v clang-15 > /dev/null; then
+        clang-15 "${@:3}" -x ir $2 -x c runtime.c -o $1
+        return $?
+    fi
 
-    # clang-format -i generated_main.cpp
+    if [ $# -ne 3 ]; then
+        return 1
+    fi
+
+    local opaque=
+    if [ "$(llc --version | sed -n 's/.*LLVM version \([0-9]*\).*/\1/p')" -lt 15 ]; then
+        opaque=-opaque-pointers
+    fi
+    opt $opaque $3 $2 -o $1.bc &&
+        llc $opaque $3 -relocation-model=pic -filetype=obj $1.bc -o $1.o &&
+        cc $3 runtime.c $1.o -o $1
+    local status=$?
+    rm -f $1.bc $1.o
+    return $status
+}
+
+# Builds the C++ in $2 into $1, with the flags that follow. out.h is found
+# from here, wherever $2 is
+build_cpp() {
+    clang++-15 -std=c++17 -I. "${@:3}" $2 -o $1 -ljsoncpp
+}
+
+# Builds $1.pgo from $3 with $2 at -O3 and the flags that follow, using the
+# profile of a training run when clang can instrument it. IR input can only
+# be instrumented by the IR level -fprofile-generate
+build_optimized() {
+    local out=$1.pgo build=$2 source=$3 tmp=$(mktemp $1.XXXXXX.tmp)
+    local profdata=$(command -v llvm-profdata-15 || command -v llvm-profdata)
+    local generate=-fprofile-instr-generate use=-fprofile-instr-use
+    if [ $build = build_llvm ]; then
+        generate=-fprofile-generate
+        use=-fprofile-use
+    fi
 
-    clang++-15 -std=c++17 -O3 generated_main.cpp -o cpp-rinher-runner  -ljsoncpp -flto > /dev/null 2>&1
-    if [ $? -eq 0 ]; then
+    if [ -n "$profdata" ] &&
+        $build $out.instr $source -O3 "${@:4}" $generate; then
+        LLVM_PROFILE_FILE=$out.profraw RINHA_TRAIN_SECONDS=$PGO_TRAIN_SECONDS \
+            $out.instr < /dev/null > /dev/null 2>&1
+        $profdata merge -o $out.profdata $out.profraw &&
+            $build $tmp $source -O3 "${@:4}" $use=$out.profdata
+        rm -f $out.instr $out.profraw $out.profdata
+    fi
+
+    if [ ! -x $tmp ]; then
+        $build $tmp $source -O3 "${@:4}"
+    fi
+    [ -x $tmp ] && mv $tmp $out
+    rm -f $tmp
+}
+
+# Removes the files of CACHE_DIR used least recently until it fits in
+# CACHE_MAX_KB. Locks and the files of builds in progress are left alone
+evict_cache() {
+    local used=$(du -sk $CACHE_DIR | cut -f1) file
+    for file in $(ls -tr $CACHE_DIR); do
+        if [ $used -le $CACHE_MAX_KB ]; then
+            break
+        fi
+        case $file in
+            *.lock | *.tmp* | *.cpp | *.ll | *.instr | *.prof*) continue ;;
+        esac
+        used=$((used - $(du -sk $CACHE_DIR/$file | cut -f1)))
+        rm -f $CACHE_DIR/$file
+    done
+}
+
+# Runs the runner $2 builds out of $3 for the code hashed to $1, built first
+# at $4 and then with the flags that follow when optimized. Sets ran when
+# there was a runner to run, and returns its status
+run_cached() {
+    local runner=$CACHE_DIR/$1 build=$2 source=$3 quick=$4
+    mkdir -p $CACHE_DIR
+    ran=
+
+    if [ -x $runner.pgo ]; then
+        touch $runner.pgo
+        cp $runner.pgo cpp-rinher-runner
+        ran=1
         ./cpp-rinher-runner
-        exit $?
+        return $?
     fi
+
+    if [ "$CACHE_PERSISTENT" != 1 ]; then
+        $build cpp-rinher-runner $source -O3 "${@:5}" > /dev/null 2>&1 || return 1
+        ran=1
+        ./cpp-rinher-runner
+        return $?
+    fi
+
+    if [ ! -x $runner ]; then
+        # Runs building the same program at once each build into a file of
+        # their own, and the last one to finish is the one kept
+        local tmp=$(mktemp $runner.XXXXXX.tmp)
+        $build $tmp $source $quick > /dev/null 2>&1 && mv $tmp $runner
+        rm -f $tmp
+        evict_cache
+    fi
+    if [ ! -x $runner ]; then
+        return 1
+    fi
+    touch $runner
+
+    cp $runner cpp-rinher-runner
+    ran=1
+    local start=$(date +%s%N)
+    ./cpp-rinher-runner
+    local status=$?
+    local elapsed=$((($(date +%s%N) - start) / 1000000))
+
+    # The next run regenerates the source, so the rebuild works on a copy.
+    # The lock keeps runs of the same program from rebuilding it twice
+    if [ $elapsed -ge $PGO_THRESHOLD_MS ]; then
+        local copy=$runner.$$.${source##*.}
+        cp $source $copy
+        (
+            flock -n 9 && build_optimized $runner $build $copy "${@:5}"
+            rm -f $copy
+            evict_cache
+        ) 9> $runner.lock > /dev/null 2>&1 &
+
+        # A container stops once its first process exits, killing the
+        # rebuild, so there it is waited for after the output is out
+        if [ $$ -eq 1 ]; then
+            wait
+        fi
+    fi
+    return $status
+}
+
+# With --eval, programs that finish within the compiler's budget of steps,
+# memory and time have their output written to generated_output.txt and
+# never reach clang. Profiled programs have to actually run, so they are not
+# evaluated
+eval=--eval
+for arg in "${@:2}"; do
+    if [ "$arg" = --profile ]; then
+        eval=
+    fi
+done
+
+# Runs the program with the backend of mode $1, exiting with its status if
+# it could be built
+run_mode() {
+    local generated=generated_main.cpp
+    if [ $1 -eq 2 ]; then
+        generated=generated_main.ll
+    fi
+
+    # The code generated for an input is kept along with its runner, so a
+    # program that ran before doesn't go through the compiler, or its
+    # --eval, again
+    local input=$CACHE_DIR/$({ cat $JSON ./cpp-rinher-compiler; echo "$*"; } |
+        sha1sum | cut -d' ' -f1).src
+    if [ "$CACHE_PERSISTENT" = 1 ] && [ -f $input ]; then
+        touch $input
+        cp $input $generated
+    else
+        ./cpp-rinher-compiler $JSON $1 $eval "${@:2}" || return
+
+        if [ -f generated_output.txt ]; then
+            cat generated_output.txt
+            exit 0
+        fi
+
+        if [ "$CACHE_PERSISTENT" = 1 ]; then
+            mkdir -p $CACHE_DIR
+            local tmp=$(mktemp $input.XXXXXX.tmp)
+            cp $generated $tmp && mv $tmp $input
+        fi
+    fi
+
+    # clang-format -i generated_main.cpp
+
+    if [ $1 -eq 2 ]; then
+        # Tail calls are emitted as musttail, so loops written as recursion
+        # don't need an optimized build to run in constant stack
+        run_cached $(cat generated_main.ll runtime.c | sha1sum | cut -d' ' -f1) \
+            build_llvm generated_main.ll -O1
+    else
+        # clang only turns tail calls into jumps from -O2
+        run_cached $(cat generated_main.cpp out.h | sha1sum | cut -d' ' -f1) \
+            build_cpp generated_main.cpp -O2 -flto
+    fi
+    local status=$?
+    if [ -n "$ran" ]; then
+        exit $status
+    fi
+}
+
+# The C++ runner comes first: the LLVM one is still slower on recursive
+# code like fib. RINHA_BACKEND=llvm tries it first, falling back to C++,
+# which is the only one that can be profiled
+JSON=$1
+if [ "$RINHA_BACKEND" = llvm ]; then
+    run_mode 2 "${@:2}"
 fi
+run_mode 1 "${@:2}"
 
 ./cpp-rinher-compiler $1 0
 
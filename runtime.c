@@ -0,0 +1,637 @@
+// Runtime of the programs generated as LLVM IR (see llvm.cpp). The
+// generated module defines rinha_main and calls back into these functions
+// for anything that isn't inlined.
+//
+// Values are 64 bits. The low 3 bits are a tag: ints and bools carry their
+// value above it, and heap objects (strings, tuples, closures) are 8 byte
+// aligned pointers, tagged 0.
+
+#include <inttypes.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef int64_t rt_value;
+
+#define RT_TAG_MASK 7
+#define RT_TAG_INT 1
+#define RT_TAG_BOOL 2
+
+enum { RT_STR = 1, RT_TUPLE = 2, RT_CLOSURE = 3 };
+
+// Objects emitted as constants by the compiler, never freed
+#define RT_STATIC 1
+
+typedef struct {
+  uint32_t kind;
+  uint32_t flags;
+} rt_object;
+
+typedef struct {
+  rt_object header;
+  int64_t length;
+  char data[];
+} rt_string;
+
+typedef struct {
+  rt_object header;
+  rt_value first, second;
+} rt_tuple;
+
+typedef struct {
+  rt_object header;
+  void *fn;
+  int64_t arity;
+  int64_t count;
+  rt_value captures[];
+} rt_closure;
+
+rt_value rinha_main(void);
+
+static inline bool rt_is_int(rt_value v) {
+  return (v & RT_TAG_MASK) == RT_TAG_INT;
+}
+
+static inline bool rt_is_bool(rt_value v) {
+  return (v & RT_TAG_MASK) == RT_TAG_BOOL;
+}
+
+static inline int32_t rt_int_of(rt_value v) { return (int32_t)(v >> 3); }
+
+static inline rt_value rt_of_int(int32_t n) {
+  return (rt_value)((uint64_t)(int64_t)n << 3) | RT_TAG_INT;
+}
+
+static inline rt_value rt_of_bool(bool b) {
+  return ((rt_value)b << 3) | RT_TAG_BOOL;
+}
+
+static inline rt_object *rt_object_of(rt_value v) {
+  return (v & RT_TAG_MASK) ? NULL : (rt_object *)(intptr_t)v;
+}
+
+static inline bool rt_is(rt_value v, uint32_t kind) {
+  rt_object *object = rt_object_of(v);
+  return object && object->kind == kind;
+}
+
+_Noreturn static void rt_fail(const char *message) {
+  fflush(stdout);
+  fprintf(stderr, "Error: %s\n", message);
+  exit(1);
+}
+
+// Objects are bump allocated in regions, aligned to their size so that any
+// address inside one (even past the start of an object) finds it by masking.
+// When enough has been allocated since the last collection, the live
+// objects are copied to fresh regions and the old ones are released whole.
+//
+// The generated code keeps values in registers and on the stack without
+// telling the runtime where, so the stack is scanned conservatively: a
+// region that any word of it points into is pinned, kept where it is with
+// all its objects, and only objects reachable from the heap are moved.
+#define RT_REGION_SIZE ((size_t)256 << 10)
+// Bytes allocated between collections, at least
+#ifndef RT_MIN_THRESHOLD
+#define RT_MIN_THRESHOLD ((size_t)8 << 20)
+#endif
+#define RT_MAX_FREE_REGIONS 16
+
+// What a copied object leaves behind, with the copy in its next word
+#define RT_FORWARDED 0
+
+typedef struct rt_region {
+  struct rt_region *next;
+  char *top, *end;
+  // How far the collection copying into this region has scanned it
+  char *scanned;
+  bool pinned;
+} rt_region;
+
+#define RT_REGION_DATA ((sizeof(rt_region) + 7) & ~(size_t)7)
+
+static struct {
+  // Regions objects are allocated in, the current one first
+  rt_region *regions;
+  rt_region *free_regions;
+  size_t free_count;
+
+  char *stack_base;
+  size_t since_collection, threshold;
+
+  // Reported with RINHA_GC_STATS
+  uint64_t allocated, collections, copied, pinned;
+  size_t heap, peak_heap, live;
+} rt_heap = {.threshold = RT_MIN_THRESHOLD};
+
+static size_t rt_round(size_t size) { return (size + 7) & ~(size_t)7; }
+
+static rt_region *rt_new_region(size_t size) {
+  size_t const bytes =
+      (RT_REGION_DATA + size + RT_REGION_SIZE - 1) & ~(RT_REGION_SIZE - 1);
+
+  rt_region *region;
+  if (bytes == RT_REGION_SIZE && rt_heap.free_regions) {
+    region = rt_heap.free_regions;
+    rt_heap.free_regions = region->next;
+    rt_heap.free_count--;
+  } else {
+    region = aligned_alloc(RT_REGION_SIZE, bytes);
+    if (!region)
+      rt_fail("out of memory");
+  }
+
+  region->top = region->scanned = (char *)region + RT_REGION_DATA;
+  region->end = (char *)region + bytes;
+  region->pinned = false;
+  region->next = rt_heap.regions;
+  rt_heap.regions = region;
+
+  rt_heap.heap += bytes;
+  if (rt_heap.heap > rt_heap.peak_heap)
+    rt_heap.peak_heap = rt_heap.heap;
+  return region;
+}
+
+static void rt_free_region(rt_region *region) {
+  size_t const bytes = region->end - (char *)region;
+  rt_heap.heap -= bytes;
+  if (bytes == RT_REGION_SIZE && rt_heap.free_count < RT_MAX_FREE_REGIONS) {
+    region->next = rt_heap.free_regions;
+    rt_heap.free_regions = region;
+    rt_heap.free_count++;
+  } else {
+    free(region);
+  }
+}
+
+static void *rt_bump(size_t size) {
+  rt_region *region = rt_heap.regions;
+  if (!region || (size_t)(region->end - region->top) < size) {
+    region = rt_new_region(size);
+
+    // A large object gets a region of its own, behind the current one
+    if (size > RT_REGION_SIZE / 4 && region->next) {
+      rt_region *current = region->next;
+      rt_heap.regions = current;
+      region->next = current->next;
+      current->next = region;
+    }
+  }
+  void *object = region->top;
+  region->top += size;
+  return object;
+}
+
+// The regions being collected, in an open addressing table from the address
+// of each RT_REGION_SIZE chunk they cover
+static struct {
+  uintptr_t *keys;
+  rt_region **values;
+  size_t mask;
+} rt_from;
+
+static size_t rt_hash(uintptr_t chunk) {
+  return (chunk / RT_REGION_SIZE * 0x9E3779B97F4A7C15ull) >> 20;
+}
+
+static void rt_from_insert(uintptr_t chunk, rt_region *region) {
+  size_t i = rt_hash(chunk) & rt_from.mask;
+  while (rt_from.keys[i])
+    i = (i + 1) & rt_from.mask;
+  rt_from.keys[i] = chunk;
+  rt_from.values[i] = region;
+}
+
+// The region being collected that address points into, if any
+static rt_region *rt_from_find(uintptr_t address) {
+  uintptr_t const chunk = address & ~(uintptr_t)(RT_REGION_SIZE - 1);
+  if (!chunk)
+    return NULL;
+  for (size_t i = rt_hash(chunk) & rt_from.mask; rt_from.keys[i];
+       i = (i + 1) & rt_from.mask) {
+    if (rt_from.keys[i] == chunk) {
+      rt_region *region = rt_from.values[i];
+      return (char *)address < region->top ? region : NULL;
+    }
+  }
+  return NULL;
+}
+
+static size_t rt_size_of(rt_object *object) {
+  switch (object->kind) {
+  case RT_STR:
+    return rt_round(sizeof(rt_string) + ((rt_string *)object)->length);
+  case RT_TUPLE:
+    return sizeof(rt_tuple);
+  default:
+    return sizeof(rt_closure) +
+           ((rt_closure *)object)->count * sizeof(rt_value);
+  }
+}
+
+// Where the object v points to lives after the collection
+static rt_value rt_forward(rt_value v) {
+  if (v & RT_TAG_MASK)
+    return v;
+  rt_region *region = rt_from_find((uintptr_t)v);
+  if (!region || region->pinned)
+    return v;
+
+  rt_object *object = rt_object_of(v);
+  if (object->kind == RT_FORWARDED)
+    return ((rt_value *)object)[1];
+
+  size_t const size = rt_size_of(object);
+  void *copy = rt_bump(size);
+  memcpy(copy, object, size);
+  rt_heap.copied += size;
+
+  object->kind = RT_FORWARDED;
+  ((rt_value *)object)[1] = (rt_value)(intptr_t)copy;
+  return (rt_value)(intptr_t)copy;
+}
+
+// Forwards the values the object at p holds, returning where the next one
+// starts
+static char *rt_scan(char *p) {
+  rt_object *object = (rt_object *)p;
+  if (object->kind == RT_TUPLE) {
+    rt_tuple *tuple = (rt_tuple *)object;
+    tuple->first = rt_forward(tuple->first);
+    tuple->second = rt_forward(tuple->second);
+  } else if (object->kind == RT_CLOSURE) {
+    rt_closure *closure = (rt_closure *)object;
+    for (int64_t i = 0; i < closure->count; i++)
+      closure->captures[i] = rt_forward(closure->captures[i]);
+  }
+  return p + rt_size_of(object);
+}
+
+// Pins the regions the stack points into, from the frame of this function
+// to that of main
+static __attribute__((noinline)) void rt_pin_stack(void) {
+  for (char *p = __builtin_frame_address(0); p < rt_heap.stack_base;
+       p += sizeof(uintptr_t)) {
+    rt_region *region = rt_from_find(*(uintptr_t *)p);
+    if (region && !region->pinned) {
+      region->pinned = true;
+      rt_heap.pinned++;
+    }
+  }
+}
+
+static __attribute__((noinline)) void rt_collect(void) {
+  // Values the generated code keeps in callee saved registers are spilled
+  // by the prologue of this function, into the part of the stack that is
+  // scanned. setjmp can't be used for it: glibc mangles the frame pointer
+  // it saves, which generated code may use as any other register
+  __builtin_unwind_init();
+
+  rt_region *from = rt_heap.regions;
+  size_t chunks = 0;
+  for (rt_region *region = from; region; region = region->next)
+    chunks += (region->end - (char *)region) / RT_REGION_SIZE;
+
+  size_t capacity = 16;
+  while (capacity < chunks * 2)
+    capacity *= 2;
+  rt_from.keys = calloc(capacity, sizeof(*rt_from.keys));
+  rt_from.values = malloc(capacity * sizeof(*rt_from.values));
+  if (!rt_from.keys || !rt_from.values)
+    rt_fail("out of memory");
+  rt_from.mask = capacity - 1;
+  for (rt_region *region = from; region; region = region->next)
+    for (char *chunk = (char *)region; chunk < region->end;
+         chunk += RT_REGION_SIZE)
+      rt_from_insert((uintptr_t)chunk, region);
+
+  rt_pin_stack();
+
+  // Pinned regions survive as they are, and everything else is copied to
+  // new regions
+  rt_heap.regions = NULL;
+  rt_region *pinned = NULL;
+  for (rt_region **region = &from; *region;) {
+    if ((*region)->pinned) {
+      rt_region *next = (*region)->next;
+      (*region)->next = pinned;
+      pinned = *region;
+      *region = next;
+    } else {
+      region = &(*region)->next;
+    }
+  }
+  for (rt_region *region = pinned; region; region = region->next)
+    for (char *p = (char *)region + RT_REGION_DATA; p < region->top;)
+      p = rt_scan(p);
+
+  // Copies are scanned until no region has any left, including the copies
+  // scanning them makes
+  for (bool scanning = true; scanning;) {
+    scanning = false;
+    for (rt_region *region = rt_heap.regions; region; region = region->next)
+      while (region->scanned < region->top) {
+        region->scanned = rt_scan(region->scanned);
+        scanning = true;
+      }
+  }
+
+  rt_heap.live = 0;
+  for (rt_region *region = rt_heap.regions; region; region = region->next)
+    rt_heap.live += region->top - ((char *)region + RT_REGION_DATA);
+
+  for (rt_region *region = from, *next; region; region = next) {
+    next = region->next;
+    rt_free_region(region);
+  }
+
+  // Allocation goes on in the copies, which come first
+  rt_region **last = &rt_heap.regions;
+  while (*last)
+    last = &(*last)->next;
+  *last = pinned;
+  for (rt_region *region = pinned; region; region = region->next) {
+    region->pinned = false;
+    region->scanned = region->top;
+    rt_heap.live += region->top - ((char *)region + RT_REGION_DATA);
+  }
+
+  free(rt_from.keys);
+  free(rt_from.values);
+  rt_from.keys = NULL;
+
+  rt_heap.collections++;
+  rt_heap.since_collection = 0;
+  rt_heap.threshold =
+      rt_heap.live * 2 > RT_MIN_THRESHOLD ? rt_heap.live * 2 : RT_MIN_THRESHOLD;
+}
+
+static void *rt_alloc(size_t size) {
+  size = rt_round(size);
+  if (rt_heap.since_collection >= rt_heap.threshold)
+    rt_collect();
+  rt_heap.since_collection += size;
+  rt_heap.allocated += size;
+  return rt_bump(size);
+}
+
+static rt_string *rt_new_string(int64_t length) {
+  rt_string *str = rt_alloc(sizeof(rt_string) + length);
+  str->header = (rt_object){RT_STR, 0};
+  str->length = length;
+  return str;
+}
+
+// Writes the decimal digits of n at the end of buffer, returning the start
+static char *rt_format_int(int32_t n, char buffer[16]) {
+  char *end = buffer + 16, *p = end;
+  uint32_t u = n < 0 ? -(uint32_t)n : (uint32_t)n;
+  do
+    *--p = '0' + u % 10;
+  while (u /= 10);
+  if (n < 0)
+    *--p = '-';
+  return p;
+}
+
+static void rt_show(rt_value v) {
+  if (rt_is_int(v)) {
+    char buffer[16];
+    char *digits = rt_format_int(rt_int_of(v), buffer);
+    fwrite(digits, 1, buffer + 16 - digits, stdout);
+    return;
+  }
+  if (rt_is_bool(v)) {
+    fputs(v >> 3 ? "true" : "false", stdout);
+    return;
+  }
+
+  rt_object *object = rt_object_of(v);
+  switch (object ? object->kind : 0) {
+  case RT_STR: {
+    rt_string *str = (rt_string *)object;
+    fwrite(str->data, 1, str->length, stdout);
+    return;
+  }
+  case RT_TUPLE: {
+    rt_tuple *tuple = (rt_tuple *)object;
+    fputs("(", stdout);
+    rt_show(tuple->first);
+    fputs(", ", stdout);
+    rt_show(tuple->second);
+    fputs(")", stdout);
+    return;
+  }
+  case RT_CLOSURE:
+    fputs("<#closure>", stdout);
+    return;
+  }
+  rt_fail("invalid value");
+}
+
+rt_value rt_print(rt_value v) {
+  rt_show(v);
+  putchar('\n');
+  return v;
+}
+
+void rt_write(const char *data, int64_t length) {
+  fwrite(data, 1, length, stdout);
+}
+
+// The text of an int or a string, for concatenation
+static const char *rt_text(rt_value v, int64_t *length, char buffer[16]) {
+  if (rt_is_int(v)) {
+    char *digits = rt_format_int(rt_int_of(v), buffer);
+    *length = buffer + 16 - digits;
+    return digits;
+  }
+  if (rt_is(v, RT_STR)) {
+    rt_string *str = (rt_string *)rt_object_of(v);
+    *length = str->length;
+    return str->data;
+  }
+  return NULL;
+}
+
+rt_value rt_add(rt_value a, rt_value b) {
+  if (rt_is_int(a) && rt_is_int(b))
+    return rt_of_int((int32_t)((uint32_t)rt_int_of(a) + (uint32_t)rt_int_of(b)));
+
+  char a_buffer[16], b_buffer[16];
+  int64_t a_length, b_length;
+  const char *a_text = rt_text(a, &a_length, a_buffer);
+  const char *b_text = rt_text(b, &b_length, b_buffer);
+  if (!a_text || !b_text)
+    rt_fail("invalid operands to +");
+
+  rt_string *str = rt_new_string(a_length + b_length);
+  memcpy(str->data, a_text, a_length);
+  memcpy(str->data + a_length, b_text, b_length);
+  return (rt_value)(intptr_t)str;
+}
+
+static void rt_check_ints(rt_value a, rt_value b, const char *op) {
+  if (!rt_is_int(a) || !rt_is_int(b)) {
+    char message[64];
+    snprintf(message, sizeof(message), "invalid operands to %s", op);
+    rt_fail(message);
+  }
+}
+
+rt_value rt_sub(rt_value a, rt_value b) {
+  rt_check_ints(a, b, "-");
+  return rt_of_int((int32_t)((uint32_t)rt_int_of(a) - (uint32_t)rt_int_of(b)));
+}
+
+rt_value rt_mul(rt_value a, rt_value b) {
+  rt_check_ints(a, b, "*");
+  return rt_of_int((int32_t)((uint32_t)rt_int_of(a) * (uint32_t)rt_int_of(b)));
+}
+
+rt_value rt_div(rt_value a, rt_value b) {
+  rt_check_ints(a, b, "/");
+  if (!rt_int_of(b))
+    rt_fail("division by zero");
+  if (rt_int_of(b) == -1)
+    return rt_of_int((int32_t)(0u - (uint32_t)rt_int_of(a)));
+  return rt_of_int(rt_int_of(a) / rt_int_of(b));
+}
+
+rt_value rt_rem(rt_value a, rt_value b) {
+  rt_check_ints(a, b, "%");
+  if (!rt_int_of(b))
+    rt_fail("division by zero");
+  if (rt_int_of(b) == -1)
+    return rt_of_int(0);
+  return rt_of_int(rt_int_of(a) % rt_int_of(b));
+}
+
+// Ints, bools and strings compare by value, with operands of the same kind
+bool rt_eq(rt_value a, rt_value b) {
+  if ((rt_is_int(a) && rt_is_int(b)) || (rt_is_bool(a) && rt_is_bool(b)))
+    return a == b;
+
+  if (rt_is(a, RT_STR) && rt_is(b, RT_STR)) {
+    rt_string *x = (rt_string *)rt_object_of(a);
+    rt_string *y = (rt_string *)rt_object_of(b);
+    return x->length == y->length && !memcmp(x->data, y->data, x->length);
+  }
+  rt_fail("invalid operands to ==");
+}
+
+bool rt_lt(rt_value a, rt_value b) {
+  rt_check_ints(a, b, "<");
+  return rt_int_of(a) < rt_int_of(b);
+}
+
+bool rt_lte(rt_value a, rt_value b) {
+  rt_check_ints(a, b, "<=");
+  return rt_int_of(a) <= rt_int_of(b);
+}
+
+bool rt_gt(rt_value a, rt_value b) {
+  rt_check_ints(a, b, ">");
+  return rt_int_of(a) > rt_int_of(b);
+}
+
+bool rt_gte(rt_value a, rt_value b) {
+  rt_check_ints(a, b, ">=");
+  return rt_int_of(a) >= rt_int_of(b);
+}
+
+void rt_bool_error(void) { rt_fail("condition is not a bool"); }
+
+void rt_div_error(void) { rt_fail("division by zero"); }
+
+rt_value rt_unbound(const char *name) {
+  char message[128];
+  snprintf(message, sizeof(message), "unbound variable %s", name);
+  rt_fail(message);
+}
+
+rt_value rt_tuple_new(rt_value first, rt_value second) {
+  rt_tuple *tuple = rt_alloc(sizeof(rt_tuple));
+  tuple->header = (rt_object){RT_TUPLE, 0};
+  tuple->first = first;
+  tuple->second = second;
+  return (rt_value)(intptr_t)tuple;
+}
+
+rt_value rt_first(rt_value v) {
+  if (!rt_is(v, RT_TUPLE))
+    rt_fail("first of a value that is not a tuple");
+  return ((rt_tuple *)rt_object_of(v))->first;
+}
+
+rt_value rt_second(rt_value v) {
+  if (!rt_is(v, RT_TUPLE))
+    rt_fail("second of a value that is not a tuple");
+  return ((rt_tuple *)rt_object_of(v))->second;
+}
+
+// The captures are stored by the caller
+rt_value rt_closure_new(void *fn, int64_t arity, int64_t count) {
+  rt_closure *closure =
+      rt_alloc(sizeof(rt_closure) + count * sizeof(rt_value));
+  closure->header = (rt_object){RT_CLOSURE, 0};
+  closure->fn = fn;
+  closure->arity = arity;
+  closure->count = count;
+  return (rt_value)(intptr_t)closure;
+}
+
+// The function to call v with arity arguments
+void *rt_callee(rt_value v, int64_t arity) {
+  if (!rt_is(v, RT_CLOSURE))
+    rt_fail("call of a value that is not a function");
+
+  rt_closure *closure = (rt_closure *)rt_object_of(v);
+  if (closure->arity != arity)
+    rt_fail("wrong number of arguments");
+  return closure->fn;
+}
+
+rt_value rt_arity_error(void) { rt_fail("wrong number of arguments"); }
+
+static void rt_report(void) {
+  fprintf(stderr,
+          "gc: %" PRIu64 " bytes allocated, %" PRIu64 " collections, %" PRIu64
+          " bytes copied, %" PRIu64 " regions pinned, %zu bytes live after "
+          "the last, %zu bytes of heap at most\n",
+          rt_heap.allocated, rt_heap.collections, rt_heap.copied,
+          rt_heap.pinned, rt_heap.live, rt_heap.peak_heap);
+}
+
+// Training runs of a PGO build (see run.sh) stop after $RINHA_TRAIN_SECONDS,
+// writing the profile gathered so far, which is only written at exit
+int __llvm_profile_write_file(void) __attribute__((weak));
+
+static void rt_stop_training(int signal) {
+  (void)signal;
+  if (__llvm_profile_write_file)
+    __llvm_profile_write_file();
+  _exit(0);
+}
+
+int main(void) {
+  static char buffer[1 << 16];
+  setvbuf(stdout, buffer, _IOFBF, sizeof(buffer));
+  rt_heap.stack_base = __builtin_frame_address(0);
+  if (getenv("RINHA_GC_STATS"))
+    atexit(rt_report);
+  const char *seconds = getenv("RINHA_TRAIN_SECONDS");
+  if (seconds) {
+    signal(SIGALRM, rt_stop_training);
+    alarm(atoi(seconds));
+  }
+
+  rinha_main();
+  fflush(stdout);
+  return 0;
+}
@@ -0,0 +1,98 @@
+#!/bin/bash
+
+# Measures how the compiler and clang scale with the size of the program.
+#
+# For every shape and size, a program is generated with cpp-rinher-astgen and
+# compiled. The time (ms) of each phase is written to scaling.csv, with the
+# LLVM backend's codegen as the llvm phase. If gnuplot is available, they are
+# also plotted to scaling-<shape>.png.
+#
+# The memory column is the peak RSS of the compiler process by the end of each
+# phase, not what the phase used on its own: it never goes down, and a phase
+# that needs less than an earlier one reports the earlier peak. clang runs in
+# a process of its own, so its peak is its own.
+#
+# Usage: ./scaling.sh [build-dir] [sizes...]
+
+# set -x
+
+BUILD_DIR=$(realpath ${1:-.})
+shift
+SIZES=${@:-1000 10000 100000 1000000}
+SHAPES=${SHAPES:-let call tuple functions if}
+CXX=${CXX:-clang++-15}
+TIMEOUT=${TIMEOUT:-300}
+
+WORK_DIR=$(mktemp -d)
+cp out.h $WORK_DIR
+OUT=$PWD/scaling.csv
+
+echo "shape,nodes,phase,ms,peak_rss_kb" > $OUT
+
+for shape in $SHAPES; do
+    for size in $SIZES; do
+        nodes=$($BUILD_DIR/cpp-rinher-astgen $shape $size 2>&1 > $WORK_DIR/gen.json)
+
+        # The compiler reports "phase ms peak-rss-so-far" for each phase on
+        # stderr
+        (cd $WORK_DIR && timeout $TIMEOUT $BUILD_DIR/cpp-rinher-compiler gen.json 1 --stats 2> stats.txt > /dev/null)
+        if [ $? -ne 0 ]; then
+            echo "$shape,$nodes,compiler,fail,fail" >> $OUT
+            continue
+        fi
+
+        while read phase ms rss; do
+            echo "$shape,$nodes,$phase,$ms,$rss" >> $OUT
+        done < $WORK_DIR/stats.txt
+
+        # Deeply nested tuples and ifs are also lowered and emitted
+        # recursively, and the LLVM backend is a separate walk over them
+        (cd $WORK_DIR && timeout $TIMEOUT $BUILD_DIR/cpp-rinher-compiler gen.json 2 --stats 2> stats.txt > /dev/null)
+        if [ $? -ne 0 ]; then
+            echo "$shape,$nodes,llvm,fail,fail" >> $OUT
+        else
+            grep '^codegen' $WORK_DIR/stats.txt | while read phase ms rss; do
+                echo "$shape,$nodes,llvm,$ms,$rss" >> $OUT
+            done
+        fi
+
+        if [ -x /usr/bin/time ]; then
+            (cd $WORK_DIR && timeout $TIMEOUT /usr/bin/time -f "%e %M" -o clang.txt $CXX -std=c++17 -O3 generated_main.cpp -o runner > /dev/null 2>&1)
+            status=$?
+            read secs rss < $WORK_DIR/clang.txt
+            ms=$(awk "BEGIN { print $secs * 1000 }")
+        else
+            start=$(date +%s%N)
+            (cd $WORK_DIR && timeout $TIMEOUT $CXX -std=c++17 -O3 generated_main.cpp -o runner > /dev/null 2>&1)
+            status=$?
+            ms=$((($(date +%s%N) - start) / 1000000))
+            rss=
+        fi
+
+        if [ $status -ne 0 ]; then
+            echo "$shape,$nodes,clang,fail,fail" >> $OUT
+        else
+            echo "$shape,$nodes,clang,$ms,$rss" >> $OUT
+        fi
+    done
+
+    if command -v gnuplot > /dev/null; then
+        gnuplot <<EOF
+set terminal png size 1200,500
+set output "scaling-$shape.png"
+set datafile separator ","
+set logscale xy
+set key left top
+set xlabel "nodes"
+set multiplot layout 1,2 title "$shape"
+set ylabel "ms"
+plot for [phase in "json ast ir codegen llvm clang"] "< grep '^$shape,.*,'.phase.',' $OUT" using 2:4 with linespoints title phase
+set ylabel "peak RSS so far (KB)"
+plot for [phase in "json ast ir codegen llvm clang"] "< grep '^$shape,.*,'.phase.',' $OUT" using 2:5 with linespoints title phase
+unset multiplot
+EOF
+    fi
+done
+
+rm -rf $WORK_DIR
+cat $OUT
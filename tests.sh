@@ -5,9 +5,9 @@
 docker buildx build --platform linux/amd64 -f ./Dockerfile -t jsc-rinher .
 
 for json_file in tests/*.json; do
-  docker run -v $PWD/$json_file:/var/rinha/source.rinha.json jsc-rinher
+  docker run -v $PWD/$json_file:/var/rinha/source.rinha.json -v rinha-cache:/cache -e RINHA_CACHE_PERSISTENT=1 jsc-rinher
 done
 
 for json_file in tests-2/*.json; do
-  docker run -v $PWD/$json_file:/var/rinha/source.rinha.json jsc-rinher
+  docker run -v $PWD/$json_file:/var/rinha/source.rinha.json -v rinha-cache:/cache -e RINHA_CACHE_PERSISTENT=1 jsc-rinher
 done
@@ -1,5 +1,10 @@
 #pragma once
 
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <string_view>
+
 #ifndef NDEBUG
 #define ABORT(msg)                                                             \
   do {                                                                         \
@@ -18,17 +23,36 @@ static inline bool has_properties(const Json::Value & /*unused*/) {
   return true;
 }
 
-#define add_return_if_needed                                                   \
-  do {                                                                         \
-    if (must_return)                                                           \
-      response.append("return ");                                              \
-  } while (0)
+// FNV-1a, stable across runs and builds so it can name cached files
+static inline uint64_t hash_string(std::string_view str,
+                                   uint64_t hash = 14695981039346656037ULL) {
+  for (unsigned char c : str) {
+    hash ^= c;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
 
-#define add_semicolon_if_needed                                                \
-  do {                                                                         \
-    if (must_return)                                                           \
-      response.append(";");                                                    \
-  } while (0)
+// Escapes a string into a literal for either C++ or Julia. Strings printed
+// at compile time by --eval end up here, so they may contain anything
+static inline std::string getStringLiteral(const std::string &str, bool julia) {
+  std::string literal = "\"";
+  for (unsigned char c : str) {
+    if (c == '\\' || c == '"' || (julia && c == '$')) {
+      literal.push_back('\\');
+      literal.push_back(c);
+    } else if (c == '\n') {
+      literal.append("\\n");
+    } else if (c < ' ' || c >= 0x7f) {
+      char octal[8];
+      snprintf(octal, sizeof(octal), "\\%03o", c);
+      literal.append(octal);
+    } else {
+      literal.push_back(c);
+    }
+  }
+  return literal.append("\"");
+}
 
 template <typename Arg1, typename... Args>
 static inline bool has_properties(const Json::Value &json, const Arg1 &arg1,